@@ -1,16 +1,32 @@
 #include "message.hpp"
 #include <iostream>
 
-Message::Message(const std::string &ip, uint16_t port, const Segment &segment)
-    : ip(ip), port(port), segment(segment) {}
+Message::Message(const std::string &ip, uint16_t port, Segment &&segment)
+    : ip(ip), port(port), segment(std::move(segment)) {}
+
+Message::Message(const std::string &ip, uint16_t port, SegmentView &&view)
+    : ip(ip), port(port), segment(std::move(view.segment)),
+      buffer(std::move(view.buffer)) {}
 
 Message::~Message() {}
 
 Message::Message(const Message &other)
-    : ip(other.ip), port(other.port), segment(other.segment) {}
+    : ip(other.ip), port(other.port), buffer(other.buffer)
+{
+    // Pooled payloads are shared through buffer, only owned ones are cloned
+    if (other.segment.ownsPayload)
+    {
+        segment = copySegment(other.segment);
+    }
+    else
+    {
+        segment = borrowSegment(other.segment);
+    }
+}
 
 Message::Message(Message &&other) noexcept
-    : ip(std::move(other.ip)), port(other.port), segment(std::move(other.segment))
+    : ip(std::move(other.ip)), port(other.port),
+      segment(std::move(other.segment)), buffer(std::move(other.buffer))
 {
     other.port = 0;
 }
@@ -21,7 +37,9 @@ Message &Message::operator=(const Message &other)
     {
         ip = other.ip;
         port = other.port;
-        segment = other.segment;
+        segment = other.segment.ownsPayload ? copySegment(other.segment)
+                                            : borrowSegment(other.segment);
+        buffer = other.buffer;
     }
     return *this;
 }
@@ -33,11 +51,21 @@ Message &Message::operator=(Message &&other) noexcept
         ip = std::move(other.ip);
         port = other.port;
         segment = std::move(other.segment);
+        buffer = std::move(other.buffer);
         other.port = 0;
     }
     return *this;
 }
 
+void Message::ownPayload()
+{
+    if (buffer.valid())
+    {
+        segment = copySegment(segment);
+        buffer.reset();
+    }
+}
+
 bool Message::operator==(const Message &other) const
 {
     return (ip == other.ip) && (port == other.port) && (segment == other.segment);
@@ -5,21 +5,30 @@
 #include <string>
 #include "../Segment/segment.hpp"
 
+/**
+ * Received segment and its sender. The payload either lives in the shared
+ * receive slot held by buffer or is owned by segment and freed with it.
+ */
 class Message
 {
 public:
     string ip;
     uint16_t port;
     Segment segment;
+    // Receive slot backing segment.payload, empty when the payload is owned
+    RecvBufferRef buffer;
 
     Message(): ip(""),port(0),segment(createSegment("",0,0)){}
-    // Constructor
-    Message(const std::string &ip, uint16_t port, const Segment &segment);
+    // Constructor taking over the segment and its payload
+    Message(const std::string &ip, uint16_t port, Segment &&segment);
+
+    // Constructor sharing the payload of a decoded view
+    Message(const std::string &ip, uint16_t port, SegmentView &&view);
 
     // Destructor
     ~Message();
 
-    // Copy constructor
+    // Copy constructor, clones an owned payload
     Message(const Message &other);
 
     // Move constructor
@@ -31,6 +40,10 @@ public:
     // Move assignment operator
     Message &operator=(Message &&other) noexcept;
 
+    // Copy a shared payload into a buffer of its own and let go of the
+    // receive slot, for messages kept long after they arrived
+    void ownPayload();
+
     // Overload equality operator
     bool operator==(const Message &other) const;
 
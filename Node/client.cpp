@@ -2,8 +2,12 @@
 #include "../Socket/socket.hpp"
 #include "../tools/fileReceiver.hpp"
 #include "../tools/tools.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <filesystem>
 #include <pthread.h>
 #include <random>
 #include <stdexcept>
@@ -49,7 +53,8 @@ ConnectionResult Client::respondFin(string dest_ip, uint16_t dest_port,
     {
       connection->setStatus(TCPStatusEnum::FIN_WAIT_1);
       Message rec_fin = connection->consumeBuffer(
-          dest_ip, dest_port, 0, seqNum + 1, FIN_FLAG, CLIENT_COMMON_TIMEOUT);
+          exactAck(dest_ip, dest_port, seqNum + 1, FIN_FLAG),
+          CLIENT_COMMON_TIMEOUT);
       commandLine(
           '+', "[" + status_strings[static_cast<int>(connection->getStatus())] +
                    "] [S=" + to_string(rec_fin.segment.seqNum) +
@@ -79,9 +84,9 @@ ConnectionResult Client::respondFin(string dest_ip, uint16_t dest_port,
 
       // REC ACK
       connection->setStatus(TCPStatusEnum::CLOSED);
-      Message answer_fin =
-          connection->consumeBuffer(dest_ip, dest_port, 0, finSeg.seqNum + 1,
-                                    ACK_FLAG, CLIENT_COMMON_TIMEOUT);
+      Message answer_fin = connection->consumeBuffer(
+          exactAck(dest_ip, dest_port, finSeg.seqNum + 1, ACK_FLAG),
+          CLIENT_COMMON_TIMEOUT);
       commandLine(
           '+', "[" + status_strings[static_cast<int>(connection->getStatus())] +
                    "] [S=" + to_string(answer_fin.segment.seqNum) +
@@ -108,6 +113,14 @@ ConnectionResult Client::startHandshake(string dest_ip, uint16_t dest_port)
   commandLine('i', "Sender Program's Three Way Handshake");
 
   Segment synSegment = syn(r_seq_num);
+  // Windows on SYN segments are never scaled
+  synSegment.window = (uint16_t)std::min(RECEIVE_WINDOW, 0xFFFFu);
+  connection->offerWindowScale(synSegment);
+  connection->offerMaxSegmentSize(synSegment);
+  if (streams > 1)
+  {
+    setStreamRange(synSegment, StreamRange{streamIndex, streams, 0, 0});
+  }
   updateChecksum(synSegment);
 
   for (int i = 0; i < 10; i++)
@@ -115,6 +128,7 @@ ConnectionResult Client::startHandshake(string dest_ip, uint16_t dest_port)
     try
     {
       // Send syn?
+      auto synSentAt = std::chrono::steady_clock::now();
       connection->sendSegment(synSegment, dest_ip, dest_port);
       connection->setStatus(TCPStatusEnum::SYN_SENT);
 
@@ -126,7 +140,13 @@ ConnectionResult Client::startHandshake(string dest_ip, uint16_t dest_port)
 
       // Wait syn-ack?
       Message result = connection->consumeBuffer(
-          dest_ip, dest_port, 0, r_seq_num + 1, SYN_ACK_FLAG, 10);
+          exactAck(dest_ip, dest_port, r_seq_num + 1, SYN_ACK_FLAG), 10);
+      // Only the first SYN gives an unambiguous sample (Karn's rule)
+      if (i == 0)
+      {
+        connection->addRttSample(std::chrono::duration_cast<microseconds>(
+            std::chrono::steady_clock::now() - synSentAt));
+      }
       commandLine(
           'i', "[" + status_strings[static_cast<int>(connection->getStatus())] +
                    "] [S=" + std::to_string(result.segment.seqNum) +
@@ -134,9 +154,20 @@ ConnectionResult Client::startHandshake(string dest_ip, uint16_t dest_port)
                    "] Received SYN-ACK request to " + dest_ip + ":" +
                    std::to_string(dest_port));
 
+      connection->acceptWindowScale(result.segment);
+      connection->acceptMaxSegmentSize(result.segment);
+      if (streams > 1 &&
+          !getStreamRange(result.segment, connection->getState().stream))
+      {
+        // The whole content would come over every stream
+        commandLine('e', "Server does not support parallel streams");
+        return ConnectionResult(false, dest_ip, dest_port, 0, 0);
+      }
+
       // Send ack?
       uint32_t ackNum = result.segment.seqNum + 1;
       Segment ackSegment = ack(r_seq_num + 1, ackNum);
+      ackSegment.window = connection->encodeWindow(RECEIVE_WINDOW);
       updateChecksum(ackSegment);
 
       connection->sendSegment(ackSegment, dest_ip, dest_port);
@@ -163,6 +194,101 @@ ConnectionResult Client::startHandshake(string dest_ip, uint16_t dest_port)
   return ConnectionResult(false, dest_ip, dest_port, 0, 0);
 }
 
+bool Client::receiveStream(string dest_ip, uint16_t dest_port,
+                           DataSink &sink, std::mutex &sinkMutex,
+                           string &filename)
+{
+  // Claimed, the server's packets only reach filters naming it and never a
+  // wildcard wait on this socket
+  connection->claimPeer(dest_ip, dest_port);
+  bool received =
+      receiveClaimed(dest_ip, dest_port, sink, sinkMutex, filename);
+  connection->releasePeer(dest_ip, dest_port);
+  return received;
+}
+
+bool Client::receiveClaimed(string dest_ip, uint16_t dest_port,
+                            DataSink &sink, std::mutex &sinkMutex,
+                            string &filename)
+{
+  ConnectionResult statusHandshake = startHandshake(dest_ip, dest_port);
+  if (!statusHandshake.success)
+  {
+    std::cerr << ERROR << " Handshake failed." << std::endl;
+    return false;
+  }
+
+  // The server sends nothing at all for an empty trailing stream
+  const StreamRange &range = connection->getState().stream;
+  if (streams == 1 || range.index == 0 || range.length > 0)
+  {
+    StreamSink part(sink, sinkMutex, range.offset);
+    ConnectionResult statusReceive = connection->receiveBackN(
+        part, filename, dest_ip, dest_port, statusHandshake.seqNum + 1);
+    if (!statusReceive.success)
+    {
+      std::cerr << ERROR << " Receiving Data Process failed." << std::endl;
+      return false;
+    }
+  }
+
+  ConnectionResult statusFin = respondFin(
+      dest_ip, dest_port, statusHandshake.seqNum, statusHandshake.ackNum);
+  if (!statusFin.success)
+  {
+    std::cerr << ERROR << " Responding for Server's FIN Failed." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Client::receiveStreams(string dest_ip, uint16_t dest_port,
+                            DataSink &sink, string &filename)
+{
+  std::mutex sinkMutex;
+  // Stream 0 runs on this client's socket, the others on ephemeral ports.
+  // The server answered our broadcast already, so they contact it directly.
+  std::vector<std::unique_ptr<Client>> others;
+  std::vector<std::string> names(streams);
+  std::vector<char> succeeded(streams, 0);
+  std::vector<std::thread> threads;
+  for (uint8_t i = 1; i < streams; i++)
+  {
+    auto other = std::make_unique<Client>(ip, 0, serverPort);
+    other->streams = streams;
+    other->streamIndex = i;
+    other->connection->setMaxPayload(connection->getMaxPayload());
+    other->connection->setPathMtuProbing(connection->getPathMtuProbing());
+    other->connection->setOffload(connection->getOffload());
+    Client *stream = other.get();
+    others.push_back(std::move(other));
+    threads.emplace_back([&, stream, i]()
+    {
+      stream->connection->listen();
+      stream->connection->startListening();
+      ConnectionResult found = stream->findBroadcast(dest_ip, dest_port);
+      succeeded[i] = found.success &&
+                     stream->receiveStream(found.ip, found.port, sink,
+                                           sinkMutex, names[i]);
+    });
+  }
+  succeeded[0] = receiveStream(dest_ip, dest_port, sink, sinkMutex, names[0]);
+  for (std::thread &thread : threads)
+  {
+    thread.join();
+  }
+
+  for (const std::string &name : names)
+  {
+    if (!name.empty())
+    {
+      filename = name;
+    }
+  }
+  return std::all_of(succeeded.begin(), succeeded.end(),
+                     [](char ok) { return ok != 0; });
+}
+
 void Client::run()
 {
   connection->listen();
@@ -176,45 +302,58 @@ void Client::run()
     exit(0);
   }
 
-  ConnectionResult statusHandshake =
-      startHandshake(statusBroadcast.ip, statusBroadcast.port);
-  if (!statusHandshake.success)
+  // Data is written to a partial file as it arrives, the name only comes
+  // with the last segment. It is created in the directory the result goes
+  // to, so the final rename never crosses filesystems.
+  std::filesystem::path outputDir = std::filesystem::current_path();
+  std::string partialPath =
+      (outputDir / (".received-" + std::to_string(port) + ".part")).string();
+  FileSink sink(partialPath);
+  if (!sink.isOpen())
   {
-    std::cerr << ERROR << " Handshake failed. Terminating Client. Thank you!" << std::endl;
+    std::cerr << ERROR << " Unable to create " << partialPath << ". Terminating Client. Thank you!" << std::endl;
     exit(0);
   }
 
-  vector<Segment> res;
-  ConnectionResult statusReceive =
-      connection->receiveBackN(res, statusBroadcast.ip, statusBroadcast.port,
-                               statusHandshake.seqNum + 1);
-  if (!statusReceive.success)
+  std::string filename;
+  bool received;
+  if (streams > 1)
   {
-    std::cerr << ERROR << " Receiving Data Process failed. Terminating Client. Thank you!" << std::endl;
-    exit(0);
+    received = receiveStreams(statusBroadcast.ip, statusBroadcast.port, sink,
+                              filename);
   }
-
-  ConnectionResult statusFin =
-      respondFin(statusBroadcast.ip, statusBroadcast.port,
-                 statusHandshake.seqNum, statusHandshake.ackNum);
-  if (!statusFin.success)
+  else
   {
-    std::cerr << ERROR << " Responding for Server's FIN Failed. Terminating Client. Thank you!" << std::endl;
+    std::mutex sinkMutex;
+    received = receiveStream(statusBroadcast.ip, statusBroadcast.port, sink,
+                             sinkMutex, filename);
+  }
+  if (!received || !sink.close())
+  {
+    std::remove(partialPath.c_str());
+    std::cerr << ERROR << " Transfer failed. Terminating Client. Thank you!" << std::endl;
     exit(0);
   }
 
-  if (res.back().flags.ece == 1)
+  if (!filename.empty())
   {
-    std::string filename(reinterpret_cast<char *>(res.back().payload),
-                         res.back().payloadSize);
-    res.pop_back();
-    std::string result = connection->concatenatePayloads(res);
-    convertFromStrToFile(filename, result);
+    // Only the name is taken from the server, never a directory
+    std::filesystem::path name = std::filesystem::path(filename).filename();
+    if (name.empty() || name == "." || name == "..")
+    {
+      name = "received";
+    }
+    if (!moveReceivedFile(partialPath, (outputDir / name).string()))
+    {
+      // Keep the data, the user can still rename it by hand
+      std::cerr << ERROR << " Received data kept in " << partialPath << ". Terminating Client." << std::endl;
+      exit(1);
+    }
     std::cout << OUT << " Terminating Client. Thank you!" << std::endl;
   }
   else
   {
-    std::string result = connection->concatenatePayloads(res);
+    std::string result = takeReceivedText(partialPath);
     std::cout << OUT << " String received from Server. Result: " << std::endl;
     std::cout << OUT <<" "<< result << std::endl;
     std::cout << OUT << " Terminating Client. Thank you!" << std::endl;
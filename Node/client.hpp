@@ -6,19 +6,38 @@
 #include "../Socket/socket.hpp"
 #include <string>
 #include <iostream>
+#include <mutex>
 #include <thread>
 
+// Most connections one transfer may be split over
+const int MAX_STREAMS = 64;
+
 class Client : public Node
 {
 public:
   Client(const std::string &myIP, int myport, int serverPort) : Node(myIP, myport),serverPort(serverPort) {}
   void run() override;
+  void setStreams(uint8_t count) { streams = count > 0 ? count : 1; }
 
   ConnectionResult findBroadcast(string dest_ip, uint16_t dest_port);
   ConnectionResult startHandshake(string dest_ip, uint16_t dest_port);
   ConnectionResult respondFin(string dest_ip, uint16_t dest_port, uint32_t seqNum,uint32_t ackNum); 
 private:
   int serverPort;
+  // Connections one transfer is split over, and which of them this one is
+  uint8_t streams = 1;
+  uint8_t streamIndex = 0;
+
+  // Handshake, receive into sink and close for one connection, the
+  // stream's part is written at its offset in sink
+  bool receiveStream(string dest_ip, uint16_t dest_port, DataSink &sink,
+                     std::mutex &sinkMutex, string &filename);
+  // receiveStream's work, run while the server is claimed on our socket
+  bool receiveClaimed(string dest_ip, uint16_t dest_port, DataSink &sink,
+                      std::mutex &sinkMutex, string &filename);
+  // Run every stream at once, each further one on its own socket
+  bool receiveStreams(string dest_ip, uint16_t dest_port, DataSink &sink,
+                      string &filename);
 };
 
 #endif // CLIENT_HPP
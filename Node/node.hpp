@@ -15,6 +15,7 @@ protected:
   string item;
   string fileName;
   string fileEx;
+  string filePath; // read lazily while sending instead of into item
   uint16_t port;
   TCPSocket *connection;
 
@@ -24,6 +25,14 @@ public:
   virtual void run() = 0;
   void setItem(const std::string &string);
   void setItemFromBin(const std::string &binaryString);
+  void setArqMode(ArqMode mode) { connection->setArqMode(mode); }
+  void setCongestionControl(CongestionAlgorithm algo)
+  {
+    connection->setCongestionControl(algo);
+  }
+  void setMaxPayload(uint32_t size) { connection->setMaxPayload(size); }
+  void setPathMtuProbing(bool enable) { connection->setPathMtuProbing(enable); }
+  bool setOffload(bool enable) { return connection->setOffload(enable); }
 
   // Implemented in Header
   std::string getItem() const { return item; }
@@ -31,6 +40,8 @@ public:
   void setFileName(const std::string &name) { fileName = name; }
   std::string getFileEx() const { return fileEx; }
   void setFileEx(const std::string &extension) { fileEx = extension; }
+  std::string getFilePath() const { return filePath; }
+  void setFilePath(const std::string &path) { filePath = path; }
 };
 
 #endif
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include "server.hpp"
 #include "../tools/tools.hpp"
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <stdexcept>
 #include <string>
 
@@ -7,48 +10,79 @@ int SERVER_BROADCAST_TIMEOUT = 10; // temporary
 int SERVER_COMMON_TIMEOUT = 12;    // temporary
 int SERVER_MAX_TRY = 10;
 
-ConnectionResult Server::respondHandshake(string dest_ip, uint16_t dest_port)
+ConnectionResult Server::respondHandshake(ConnectionState &state,
+                                          string dest_ip, uint16_t dest_port,
+                                          uint64_t contentSize)
 {
   for(int i=0;i<SERVER_MAX_TRY;i++)
   {
     try
     {
       Message sync_message =
-          connection->consumeBuffer("", 0, 0, 0, SYN_FLAG, 10);
-      connection->setStatus(TCPStatusEnum::SYN_RECEIVED);
+          connection->consumeBuffer(dest_ip, dest_port, 0, 0, SYN_FLAG, 10);
+      state.status = TCPStatusEnum::SYN_RECEIVED;
       std::string destIP = sync_message.ip;
       uint16_t destPort = sync_message.port;
       uint32_t sequence_num_first = sync_message.segment.seqNum;
 
       commandLine(
-          'i', "[" + status_strings[static_cast<int>(connection->getStatus())] +
+          'i', "[" + status_strings[static_cast<int>(state.status)] +
                    "] [S=" + std::to_string(sequence_num_first) +
                    "] Received SYN request from " + dest_ip + ":" +
                    std::to_string(destPort));
 
       // Sending SYN-ACK Request
-      uint32_t sequence_num_second = generateRandomNumber(1, 1000);
+      uint32_t sequence_num_second = generateRandomNumber(1, UINT32_MAX);
       uint32_t ack_num_second = sequence_num_first + 1;
 
       commandLine(
-          'i', "[" + status_strings[static_cast<int>(connection->getStatus())] +
+          'i', "[" + status_strings[static_cast<int>(state.status)] +
                    "] [S=" + std::to_string(sequence_num_second) +
                    "] [A=" + std::to_string(ack_num_second) +
                    "] Sending SYN-ACK request to " + dest_ip + ":" +
                    std::to_string(destPort));
       Segment synSeg = synAck(sequence_num_second, ack_num_second);
+      // Scaling is only in effect when both sides offer it
+      state.acceptWindowScale(sync_message.segment);
+      state.acceptMaxSegmentSize(sync_message.segment,
+                                 connection->getMaxPayload());
+      connection->offerMaxSegmentSize(synSeg);
+      uint8_t peerShift = 0;
+      if (getWindowScale(sync_message.segment, peerShift))
+      {
+        ConnectionState::offerWindowScale(synSeg);
+      }
+      // A client pulling one of several streams learns where its part starts
+      StreamRange range;
+      if (getStreamRange(sync_message.segment, range))
+      {
+        splitRange(contentSize, range.index, range.count, range.offset,
+                   range.length);
+        state.stream = range;
+        setStreamRange(synSeg, range);
+      }
+      synSeg.window = (uint16_t)std::min(RECEIVE_WINDOW, 0xFFFFu);
       updateChecksum(synSeg);
+      auto synAckSentAt = std::chrono::steady_clock::now();
       connection->sendSegment(synSeg, dest_ip, dest_port);
-      connection->setStatus(TCPStatusEnum::SYN_SENT);
+      state.status = TCPStatusEnum::SYN_SENT;
 
       // Received ACK Request
       Message ack_message =
           connection->consumeBuffer(destIP, destPort, 0, 0, ACK_FLAG);
-      connection->setStatus(TCPStatusEnum::ESTABLISHED);
+      // Seed the retransmission timer; later attempts are ambiguous
+      if (i == 0)
+      {
+        state.rtt.addSample(std::chrono::duration_cast<microseconds>(
+            std::chrono::steady_clock::now() - synAckSentAt));
+      }
+      state.status = TCPStatusEnum::ESTABLISHED;
+      // The client's buffer size bounds our first flight
+      state.peerWindow = state.decodeWindow(ack_message.segment.window);
       uint32_t ack_num_third = ack_message.segment.ackNum;
       uint32_t seq_num_third = ack_message.segment.seqNum;
       commandLine(
-          'i', "[" + status_strings[static_cast<int>(connection->getStatus())] +
+          'i', "[" + status_strings[static_cast<int>(state.status)] +
                    "] [A=" + std::to_string(ack_num_third) +
                    "] Received ACK request from " + dest_ip + ":" +
                    std::to_string(destPort));
@@ -74,71 +108,84 @@ ConnectionResult Server::listenBroadcast()
 {
   std::cout<<std::endl;
   commandLine('i', "Listening to the broadcast port for clients.");
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(SERVER_BROADCAST_TIMEOUT);
+  // Peers being served are claimed, so anything else reaching this wildcard
+  // filter is either a new client or a stray from a finished connection
+  while (std::chrono::steady_clock::now() < deadline)
+  {
     try
     {
+      int left = (int)std::chrono::duration_cast<std::chrono::seconds>(
+                     deadline - std::chrono::steady_clock::now())
+                     .count();
       Message answer =
-          connection->consumeBuffer("", 0, 0, 0, 0, SERVER_BROADCAST_TIMEOUT);
-      connection->setStatus(TCPStatusEnum::LISTENING);
-      commandLine('+', "Received Broadcast Message");
-      Segment temp = accBroad();
-      updateChecksum(temp);
-      connection->sendSegment(temp, answer.ip, answer.port);
+          connection->consumeBuffer("", 0, 0, 0, 0, std::max(left, 1));
+      if (getFlags8(&answer.segment) != 0)
+      {
+        continue;
+      }
+      commandLine('+', "Received Broadcast Message from " + answer.ip + ":" +
+                           std::to_string(answer.port));
       return ConnectionResult(true, answer.ip, answer.port,
                               answer.segment.seqNum, answer.segment.ackNum);
     }
     catch (const std::runtime_error &e)
     {
-      return ConnectionResult(false, "", 0, 0, 0);
+      break;
     }
   }
+  return ConnectionResult(false, "", 0, 0, 0);
+}
 
-ConnectionResult Server::startFin(string dest_ip, uint16_t dest_port,
-                                  uint32_t seqNum, uint32_t ackNum)
+ConnectionResult Server::startFin(ConnectionState &state, string dest_ip,
+                                  uint16_t dest_port, uint32_t seqNum,
+                                  uint32_t ackNum)
 {
   for (int i = 0; i < SERVER_MAX_TRY; i++)
   {
     try
     {
       // Send Fin
-      connection->setStatus(TCPStatusEnum::CLOSE_WAIT);
+      state.status = TCPStatusEnum::CLOSE_WAIT;
       Segment finSeg = fin(seqNum + 1, ackNum);
       updateChecksum(finSeg);
       connection->sendSegment(finSeg, dest_ip, dest_port);
       commandLine(
-          'i', "[" + status_strings[static_cast<int>(connection->getStatus())] +
+          'i', "[" + status_strings[static_cast<int>(state.status)] +
                    "] [S=" + to_string(finSeg.seqNum) + "] [A=" +
                    to_string(finSeg.ackNum) + "] Sending FIN request to " +
                    dest_ip + ":" + to_string(dest_port));
       // REC ACK
-      Message answer_fin =
-          connection->consumeBuffer(dest_ip, dest_port, 0, finSeg.seqNum + 1,
-                                    ACK_FLAG, SERVER_COMMON_TIMEOUT);
+      Message answer_fin = connection->consumeBuffer(
+          exactAck(dest_ip, dest_port, finSeg.seqNum + 1, ACK_FLAG),
+          SERVER_COMMON_TIMEOUT);
       commandLine(
-          '+', "[" + status_strings[static_cast<int>(connection->getStatus())] +
+          '+', "[" + status_strings[static_cast<int>(state.status)] +
                    "] [S=" + to_string(answer_fin.segment.seqNum) +
                    "] [A=" + to_string(answer_fin.segment.ackNum) +
                    "] Received ACK request from  " + dest_ip +
                    to_string(dest_port));
       // REC FIN
-      connection->setStatus(TCPStatusEnum::LAST_ACK);
-      Message fin2 =
-          connection->consumeBuffer(dest_ip, dest_port, 0, finSeg.seqNum + 1,
-                                    FIN_FLAG, SERVER_COMMON_TIMEOUT);
+      state.status = TCPStatusEnum::LAST_ACK;
+      Message fin2 = connection->consumeBuffer(
+          exactAck(dest_ip, dest_port, finSeg.seqNum + 1, FIN_FLAG),
+          SERVER_COMMON_TIMEOUT);
       commandLine(
-          '+', "[" + status_strings[static_cast<int>(connection->getStatus())] +
+          '+', "[" + status_strings[static_cast<int>(state.status)] +
                    "] [S=" + to_string(fin2.segment.seqNum) +
                    "] [A=" + to_string(fin2.segment.ackNum) +
                    "] Received FIN request from  " + dest_ip +
                    to_string(dest_port));
 
       // Send ACK
-      connection->setStatus(TCPStatusEnum::CLOSED);
+      state.status = TCPStatusEnum::CLOSED;
       Segment ackSeg = ack(seqNum + 2, fin2.segment.seqNum + 1);
       updateChecksum(ackSeg);
       connection->sendSegment(ackSeg, dest_ip, dest_port);
 
       commandLine(
-          'i', "[" + status_strings[static_cast<int>(connection->getStatus())] +
+          'i', "[" + status_strings[static_cast<int>(state.status)] +
                    "] [S=" + to_string(ackSeg.seqNum) + "] [A=" +
                    to_string(ackSeg.ackNum) + "] Sending FIN request to " +
                    dest_ip + ":" + to_string(dest_port));
@@ -155,63 +202,245 @@ ConnectionResult Server::startFin(string dest_ip, uint16_t dest_port,
   return ConnectionResult(false, dest_ip, dest_port, 0, 0);
 }
 
-void Server::run()
+Server::~Server()
 {
-  connection->listen();
-  connection->startListening();
-
-  while (true)
+  // Shard threads sit in acceptLoop until their socket is stopped
+  stop();
+  for (auto &shard : shards)
   {
-    connection->setStatus(TCPStatusEnum::LISTENING);
-    ConnectionResult statusBroadcast = listenBroadcast();
-    if (!statusBroadcast.success)
+    shard->stop();
+  }
+  for (std::thread &shardThread : shardThreads)
+  {
+    shardThread.join();
+  }
+  for (auto &entry : sessions)
+  {
+    if (entry.second->worker.joinable())
     {
-      std::cerr << ERROR<<" Failed to receive broadcast. Restarting Server." << std::endl;
-      continue;
+      entry.second->worker.join();
     }
+  }
+}
 
-    ConnectionResult statusHandshake = respondHandshake(statusBroadcast.ip, statusBroadcast.port);
-    if (!statusHandshake.success)
-    {
-      std::cerr << ERROR<<" Handshake response failed. Restarting Server." << std::endl;
-      continue;
-    }
+void Server::stop()
+{
+  stopping.store(true);
+  connection->stopListening();
+}
 
-    bool isFile = true;
-    std::string fileFullName;
-    if (fileEx == "-1")
+void Server::reapSessions()
+{
+  for (auto it = sessions.begin(); it != sessions.end();)
+  {
+    if (it->second->done.load())
     {
-      isFile = false;
+      it->second->worker.join();
+      it = sessions.erase(it);
     }
     else
     {
-      fileFullName = fileEx.empty() ? fileName : fileName + "." + fileEx;
+      ++it;
     }
+  }
+}
+
+void Server::serve(Session &session, string dest_ip, uint16_t dest_port)
+{
+  ConnectionState &state = session.state;
+  auto finish = [&]()
+  {
+    connection->releasePeer(dest_ip, dest_port);
+    session.done.store(true);
+  };
+
+  bool isFile = true;
+  std::string fileFullName;
+  if (fileEx == "-1")
+  {
+    isFile = false;
+  }
+  else
+  {
+    fileFullName = fileEx.empty() ? fileName : fileName + "." + fileEx;
+  }
+
+  // Files are streamed from disk, user input is sent from memory. Every
+  // connection reads through its own source, sources over the same file
+  // leave its pages cached for each other.
+  std::unique_ptr<DataSource> source;
+  if (isFile && !filePath.empty())
+  {
+    auto fileSource = std::make_unique<FileSource>(filePath);
+    if (!fileSource->isOpen())
+    {
+      std::cerr << ERROR << " Unable to open " << filePath << "." << std::endl;
+      finish();
+      return;
+    }
+    source = std::move(fileSource);
+  }
+  else
+  {
+    source = std::make_unique<MemorySource>(
+        reinterpret_cast<const uint8_t *>(item.data()), item.length());
+  }
+
+  ConnectionResult statusHandshake =
+      respondHandshake(state, dest_ip, dest_port, source->size());
+  if (!statusHandshake.success)
+  {
+    std::cerr << ERROR << " Handshake response from " << dest_ip << ":" << dest_port << " failed." << std::endl;
+    finish();
+    return;
+  }
+
+  // One of several streams only carries its own part of the content
+  DataSource *sending = source.get();
+  std::unique_ptr<DataSource> part;
+  if (state.stream.count > 1)
+  {
+    uint64_t offset = state.stream.offset;
+    uint64_t length = state.stream.length;
+    commandLine('i', "Stream " + std::to_string(state.stream.index + 1) + "/" +
+                         std::to_string(state.stream.count) + " to " + dest_ip +
+                         ":" + std::to_string(dest_port) + " carries bytes " +
+                         std::to_string(offset) + "-" +
+                         std::to_string(offset + length));
+    part = std::make_unique<RangeSource>(*source, offset, length);
+    sending = part.get();
+  }
 
-    ConnectionResult statusSend = connection->sendBackN(
-        reinterpret_cast<uint8_t *>(item.data()),
-        static_cast<uint32_t>(item.length()),
-        statusBroadcast.ip,
-        statusBroadcast.port,
+  // Trailing streams of a small input have nothing to carry, not even the
+  // file name, which the first stream brings. Both sides skip to FIN.
+  bool emptyStream = state.stream.count > 1 && state.stream.index > 0 &&
+                     state.stream.length == 0;
+  ConnectionResult statusSend(true, dest_ip, dest_port, 0, 0);
+  if (!emptyStream)
+  {
+    statusSend = connection->sendBackN(
+        state,
+        *sending,
+        dest_ip,
+        dest_port,
         statusHandshake.ackNum,
         isFile,
         fileFullName);
-    if (!statusSend.success)
+  }
+  if (!statusSend.success)
+  {
+    std::cerr << ERROR << " Sending data to " << dest_ip << ":" << dest_port << " failed." << std::endl;
+    finish();
+    return;
+  }
+  cout << OUT << " Start waiting for Client if Server finished first." << endl;
+  std::this_thread::sleep_for(std::chrono::seconds(5));
+
+  ConnectionResult statusFin = startFin(
+      state,
+      dest_ip,
+      dest_port,
+      statusHandshake.seqNum,
+      statusHandshake.ackNum);
+  if (!statusFin.success)
+  {
+    std::cerr << ERROR << " FIN process with " << dest_ip << ":" << dest_port << " failed." << std::endl;
+  }
+  finish();
+}
+
+void Server::startShards()
+{
+  if (workers <= 1)
+  {
+    return;
+  }
+  for (uint32_t i = 1; i < workers; i++)
+  {
+    auto shard = std::make_unique<Server>(ip, port);
+    shard->item = item;
+    shard->fileName = fileName;
+    shard->fileEx = fileEx;
+    shard->filePath = filePath;
+    shard->workers = workers;
+    shard->shardIndex = i;
+    shard->connection->getState().configureLike(connection->getState());
+    shard->connection->setMaxPayload(connection->getMaxPayload());
+    shard->connection->setPathMtuProbing(connection->getPathMtuProbing());
+    shard->connection->setOffload(connection->getOffload());
+    shard->connection->setReusePort();
+    shard->connection->listen();
+    shard->connection->startListening();
+    shards.push_back(std::move(shard));
+  }
+  // Without steering every worker would answer every broadcast while the
+  // kernel hands the handshake to just one of them, so serve alone instead
+  if (!connection->steerByPeerPort(workers))
+  {
+    cout << ERROR << " Could not steer flows by peer port, serving with a single worker." << endl;
+    shards.clear();
+    workers = 1;
+    return;
+  }
+  for (uint32_t i = 1; i < workers; i++)
+  {
+    shardThreads.emplace_back(&Server::acceptLoop, shards[i - 1].get());
+  }
+  commandLine('i', "Serving with " + std::to_string(workers) + " workers on port " + std::to_string(port));
+}
+
+void Server::run()
+{
+  if (workers > 1)
+  {
+    connection->setReusePort();
+  }
+  connection->listen();
+  connection->startListening();
+  startShards();
+  acceptLoop();
+}
+
+void Server::acceptLoop()
+{
+  connection->setStatus(TCPStatusEnum::LISTENING);
+
+  while (!stopping.load())
+  {
+    reapSessions();
+    ConnectionResult statusBroadcast = listenBroadcast();
+    if (!statusBroadcast.success)
     {
-      std::cerr << ERROR<<" Sending data failed. Restarting Server." << std::endl;
       continue;
     }
-    cout << OUT << " Start waiting for Client if Server finished first." << endl;
-    std::this_thread::sleep_for(std::chrono::seconds(5));
-
-    ConnectionResult statusFin = startFin(
-        statusBroadcast.ip,
-        statusBroadcast.port,
-        statusHandshake.seqNum,
-        statusHandshake.ackNum);
-    if (!statusFin.success)
+
+    // Datagrams are steered to worker peer port % workers, so a broadcast,
+    // which every worker receives, is only answered by that one
+    if (statusBroadcast.port % workers != shardIndex)
     {
-      std::cerr << ERROR<<" FIN process failed. Restarting Server." << std::endl;
+      continue;
     }
+    auto peer = std::make_pair(statusBroadcast.ip, statusBroadcast.port);
+    if (sessions.count(peer) > 0)
+    {
+      continue;
+    }
+    // Claim before answering so the client's SYN cannot reach the wildcard
+    // broadcast filter
+    connection->claimPeer(statusBroadcast.ip, statusBroadcast.port);
+    Segment temp = accBroad();
+    updateChecksum(temp);
+    connection->sendSegment(temp, statusBroadcast.ip, statusBroadcast.port);
+
+    auto session = std::make_unique<Session>();
+    session->state.configureLike(connection->getState());
+    session->state.status = TCPStatusEnum::LISTENING;
+    Session &started = *session;
+    sessions[peer] = std::move(session);
+    started.worker = std::thread(&Server::serve, this, std::ref(started),
+                                 statusBroadcast.ip, statusBroadcast.port);
+    commandLine('i', "Serving " + statusBroadcast.ip + ":" +
+                         std::to_string(statusBroadcast.port) + " (" +
+                         std::to_string(sessions.size()) + " active)");
   }
 }
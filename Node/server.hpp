@@ -5,18 +5,61 @@
 #include "../Socket/connection_result.hpp"
 #include "../Socket/socket.hpp"
 #include "node.hpp"
+#include <atomic>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "../tools/tools.hpp"
 
+/**
+ * One client being served: its own sender state and the thread running
+ * handshake, transfer and FIN for it on the shared socket.
+ */
+struct Session {
+  ConnectionState state;
+  std::thread worker;
+  std::atomic<bool> done{false};
+};
+
 class Server : public Node {
+private:
+  // Connection table keyed by peer (ip, port), only touched by run()
+  std::map<std::pair<string, uint16_t>, std::unique_ptr<Session>> sessions;
+  // Sockets bound to the same port with SO_REUSEPORT, this one included
+  uint32_t workers = 1;
+  // Position of this worker in the group, in bind order
+  uint32_t shardIndex = 0;
+  // The other workers, each a server with its own socket, listener thread
+  // and connection table
+  std::vector<std::unique_ptr<Server>> shards;
+  std::vector<std::thread> shardThreads;
+  // Set by stop(), acceptLoop returns once its socket wakes it up
+  std::atomic<bool> stopping{false};
+
+  void acceptLoop();
+  void startShards();
+
+  void serve(Session &session, string dest_ip, uint16_t dest_port);
+  // Join and drop sessions whose worker has finished
+  void reapSessions();
+
 public:
   Server(string ip, int port): Node("0.0.0.0",port){}
+  ~Server();
   void run() override;
+  // Stop accepting and stop the socket, sessions still running fail out.
+  // Safe to call from another thread, run() returns afterwards.
+  void stop();
+  void setWorkers(uint32_t count) { workers = count > 0 ? count : 1; }
 
-  ConnectionResult respondHandshake(string dest_ip, uint16_t dest_port);
-  ConnectionResult startFin(string dest_ip, uint16_t dest_port, uint32_t seqNum, uint32_t ackNum);
+  // contentSize is what the session sends, needed to place a stream's range
+  ConnectionResult respondHandshake(ConnectionState &state, string dest_ip, uint16_t dest_port, uint64_t contentSize);
+  ConnectionResult startFin(ConnectionState &state, string dest_ip, uint16_t dest_port, uint32_t seqNum, uint32_t ackNum);
   ConnectionResult listenBroadcast();
 };
 
@@ -0,0 +1,90 @@
+#include "buffer_pool.hpp"
+
+RecvBufferRef::RecvBufferRef(const RecvBufferRef &other) : slot(other.slot) {
+  if (slot != nullptr) {
+    slot->refs.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+RecvBufferRef::RecvBufferRef(RecvBufferRef &&other) noexcept
+    : slot(other.slot) {
+  other.slot = nullptr;
+}
+
+RecvBufferRef &RecvBufferRef::operator=(const RecvBufferRef &other) {
+  if (this != &other) {
+    if (other.slot != nullptr) {
+      other.slot->refs.fetch_add(1, memory_order_relaxed);
+    }
+    reset();
+    slot = other.slot;
+  }
+  return *this;
+}
+
+RecvBufferRef &RecvBufferRef::operator=(RecvBufferRef &&other) noexcept {
+  if (this != &other) {
+    reset();
+    slot = other.slot;
+    other.slot = nullptr;
+  }
+  return *this;
+}
+
+RecvBufferRef::~RecvBufferRef() { reset(); }
+
+void RecvBufferRef::reset() {
+  if (slot == nullptr) {
+    return;
+  }
+  if (slot->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+    if (slot->owner != nullptr) {
+      slot->owner->release(slot);
+    } else {
+      delete[] slot->data;
+      delete slot;
+    }
+  }
+  slot = nullptr;
+}
+
+RecvBufferPool::RecvBufferPool(uint32_t slotCount, uint32_t slotSize)
+    : slotSize(slotSize), arena(new uint8_t[(size_t)slotCount * slotSize]),
+      slots(slotCount) {
+  freeSlots.reserve(slotCount);
+  for (uint32_t i = 0; i < slotCount; i++) {
+    slots[i].refs = 0;
+    slots[i].owner = this;
+    slots[i].index = i;
+    slots[i].capacity = slotSize;
+    slots[i].data = arena + (size_t)i * slotSize;
+    freeSlots.push_back(slotCount - 1 - i);
+  }
+}
+
+RecvBufferPool::~RecvBufferPool() { delete[] arena; }
+
+RecvBufferRef RecvBufferPool::acquire() {
+  RecvSlot *slot = nullptr;
+  {
+    lock_guard<mutex> lock(mtx);
+    if (!freeSlots.empty()) {
+      slot = &slots[freeSlots.back()];
+      freeSlots.pop_back();
+    }
+  }
+  if (slot == nullptr) {
+    slot = new RecvSlot();
+    slot->owner = nullptr;
+    slot->index = 0;
+    slot->capacity = slotSize;
+    slot->data = new uint8_t[slotSize];
+  }
+  slot->refs.store(1, memory_order_relaxed);
+  return RecvBufferRef(slot);
+}
+
+void RecvBufferPool::release(RecvSlot *slot) {
+  lock_guard<mutex> lock(mtx);
+  freeSlots.push_back(slot->index);
+}
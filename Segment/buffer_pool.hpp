@@ -0,0 +1,73 @@
+#ifndef buffer_pool_h
+#define buffer_pool_h
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+class RecvBufferPool;
+
+/**
+ * One receive slot. The kernel writes a datagram straight into data and
+ * every view decoded from it shares the slot through refs.
+ */
+struct RecvSlot {
+  atomic<uint32_t> refs;
+  RecvBufferPool *owner; // nullptr when the slot was heap allocated
+  uint32_t index;
+  uint32_t capacity;
+  uint8_t *data;
+};
+
+/**
+ * Refcounted handle to a receive slot. Copying shares the slot, the slot is
+ * handed back to its pool when the last handle goes away.
+ */
+class RecvBufferRef {
+private:
+  RecvSlot *slot;
+
+public:
+  RecvBufferRef() : slot(nullptr) {}
+  explicit RecvBufferRef(RecvSlot *slot) : slot(slot) {}
+  RecvBufferRef(const RecvBufferRef &other);
+  RecvBufferRef(RecvBufferRef &&other) noexcept;
+  RecvBufferRef &operator=(const RecvBufferRef &other);
+  RecvBufferRef &operator=(RecvBufferRef &&other) noexcept;
+  ~RecvBufferRef();
+
+  uint8_t *data() const { return slot ? slot->data : nullptr; }
+  uint32_t capacity() const { return slot ? slot->capacity : 0; }
+  bool valid() const { return slot != nullptr; }
+  void reset();
+};
+
+/**
+ * Fixed set of receive slots carved out of one allocation. When every slot
+ * is in use acquire() falls back to a heap slot so the listener never
+ * blocks on the application. The pool must outlive all of its handles.
+ */
+class RecvBufferPool {
+private:
+  uint32_t slotSize;
+  uint8_t *arena;
+  vector<RecvSlot> slots;
+  vector<uint32_t> freeSlots;
+  mutex mtx;
+
+  friend class RecvBufferRef;
+  void release(RecvSlot *slot);
+
+public:
+  RecvBufferPool(uint32_t slotCount, uint32_t slotSize);
+  ~RecvBufferPool();
+  RecvBufferPool(const RecvBufferPool &) = delete;
+  RecvBufferPool &operator=(const RecvBufferPool &) = delete;
+
+  RecvBufferRef acquire();
+  uint32_t getSlotSize() const { return slotSize; }
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include "checksum.hpp"
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+
+// The kernels sum 16-bit words in host byte order. Ones' complement addition
+// commutes with swapping the bytes of every word, so the folded result is
+// swapped once at the end instead of swapping each word (RFC 1071).
+// With COPY set they also store every block they load into dst, so a copy
+// and its checksum cost one pass over the data.
+typedef uint64_t (*SumKernel)(uint8_t *dst, const uint8_t *src, size_t length);
+
+/**
+ * Eight bytes per step, split into two 32-bit halves so the 64-bit
+ * accumulator cannot overflow and no carry has to be tracked
+ */
+template <bool COPY>
+static uint64_t sumScalar(uint8_t *dst, const uint8_t *src, size_t length) {
+  uint64_t sum = 0;
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, src, 8);
+    if (COPY) {
+      memcpy(dst, &word, 8);
+      dst += 8;
+    }
+    sum += (word & 0xFFFFFFFF) + (word >> 32);
+    src += 8;
+    length -= 8;
+  }
+  while (length >= 2) {
+    uint16_t word;
+    memcpy(&word, src, 2);
+    if (COPY) {
+      memcpy(dst, &word, 2);
+      dst += 2;
+    }
+    sum += word;
+    src += 2;
+    length -= 2;
+  }
+  return sum;
+}
+
+#ifdef CHECKSUM_X86
+// Blocks summed into 32-bit lanes before they are widened into the 64-bit
+// accumulator, each block adds at most 0xFFFF to a lane
+const size_t LANE_FLUSH_BLOCKS = 32768;
+
+/**
+ * 16 bytes per step. Each 32-bit lane holds two words, the low and high
+ * words are split by mask and shift into two independent accumulators.
+ */
+template <bool COPY>
+static uint64_t sumSse2(uint8_t *dst, const uint8_t *src, size_t length) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i lowWords = _mm_set1_epi32(0xFFFF);
+  __m128i acc = zero;
+  while (length >= 16) {
+    size_t blocks = length / 16;
+    if (blocks > LANE_FLUSH_BLOCKS) {
+      blocks = LANE_FLUSH_BLOCKS;
+    }
+    __m128i low = zero;
+    __m128i high = zero;
+    for (size_t i = 0; i < blocks; i++) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+      if (COPY) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), v);
+        dst += 16;
+      }
+      low = _mm_add_epi32(low, _mm_and_si128(v, lowWords));
+      high = _mm_add_epi32(high, _mm_srli_epi32(v, 16));
+      src += 16;
+    }
+    length -= blocks * 16;
+    __m128i lanes = _mm_add_epi32(low, high);
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(lanes, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(lanes, zero));
+  }
+  uint64_t parts[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(parts), acc);
+  return parts[0] + parts[1] + sumScalar<COPY>(dst, src, length);
+}
+
+/**
+ * Same as sumSse2 over 32 bytes per step
+ */
+template <bool COPY>
+__attribute__((target("avx2"))) static uint64_t
+sumAvx2(uint8_t *dst, const uint8_t *src, size_t length) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i lowWords = _mm256_set1_epi32(0xFFFF);
+  __m256i acc = zero;
+  while (length >= 32) {
+    size_t blocks = length / 32;
+    if (blocks > LANE_FLUSH_BLOCKS) {
+      blocks = LANE_FLUSH_BLOCKS;
+    }
+    __m256i low = zero;
+    __m256i high = zero;
+    for (size_t i = 0; i < blocks; i++) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+      if (COPY) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), v);
+        dst += 32;
+      }
+      low = _mm256_add_epi32(low, _mm256_and_si256(v, lowWords));
+      high = _mm256_add_epi32(high, _mm256_srli_epi32(v, 16));
+      src += 32;
+    }
+    length -= blocks * 32;
+    __m256i lanes = _mm256_add_epi32(low, high);
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(lanes, zero));
+    acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(lanes, zero));
+  }
+  uint64_t parts[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(parts), acc);
+  return parts[0] + parts[1] + parts[2] + parts[3] +
+         sumSse2<COPY>(dst, src, length);
+}
+#endif
+
+struct ChecksumKernel {
+  SumKernel sum;
+  SumKernel copy;
+  const char *name;
+};
+
+static ChecksumKernel selectKernel() {
+#ifdef CHECKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return ChecksumKernel{sumAvx2<false>, sumAvx2<true>, "avx2"};
+  }
+  // SSE2 is part of x86-64
+  return ChecksumKernel{sumSse2<false>, sumSse2<true>, "sse2"};
+#else
+  return ChecksumKernel{sumScalar<false>, sumScalar<true>, "scalar"};
+#endif
+}
+
+static ChecksumKernel &kernel() {
+  static ChecksumKernel selected = selectKernel();
+  return selected;
+}
+
+static uint16_t toBigEndian(uint16_t folded) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return static_cast<uint16_t>((folded << 8) | (folded >> 8));
+#else
+  return folded;
+#endif
+}
+
+uint64_t checksumAdd(uint64_t sum, const uint8_t *data, size_t length) {
+  size_t even = length & ~static_cast<size_t>(1);
+  if (even > 0) {
+    sum += toBigEndian(checksumFold(kernel().sum(nullptr, data, even)));
+  }
+  if (length & 1) {
+    sum += static_cast<uint16_t>(data[even] << 8);
+  }
+  return sum;
+}
+
+uint64_t checksumCopy(uint64_t sum, uint8_t *dst, const uint8_t *src,
+                      size_t length) {
+  size_t even = length & ~static_cast<size_t>(1);
+  if (even > 0) {
+    sum += toBigEndian(checksumFold(kernel().copy(dst, src, even)));
+  }
+  if (length & 1) {
+    dst[even] = src[even];
+    sum += static_cast<uint16_t>(src[even] << 8);
+  }
+  return sum;
+}
+
+uint16_t checksumFold(uint64_t sum) {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return static_cast<uint16_t>(sum);
+}
+
+const char *checksumKernelName() { return kernel().name; }
+
+bool checksumUseKernel(const char *name) {
+  string wanted(name);
+  if (wanted == "scalar") {
+    kernel() = ChecksumKernel{sumScalar<false>, sumScalar<true>, "scalar"};
+    return true;
+  }
+#ifdef CHECKSUM_X86
+  if (wanted == "sse2") {
+    kernel() = ChecksumKernel{sumSse2<false>, sumSse2<true>, "sse2"};
+    return true;
+  }
+  __builtin_cpu_init();
+  if (wanted == "avx2" && __builtin_cpu_supports("avx2")) {
+    kernel() = ChecksumKernel{sumAvx2<false>, sumAvx2<true>, "avx2"};
+    return true;
+  }
+#endif
+  return false;
+}
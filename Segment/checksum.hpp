@@ -0,0 +1,41 @@
+#ifndef checksum_h
+#define checksum_h
+
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+
+/**
+ * Add data, read as big-endian 16-bit words, to a ones' complement running
+ * sum. An odd last byte is padded with zero, so only the final piece of a
+ * chained sum may have odd length. The result is not folded, pass it to
+ * checksumFold when done.
+ */
+uint64_t checksumAdd(uint64_t sum, const uint8_t *data, size_t length);
+
+/**
+ * Copy length bytes from src to dst and add them to sum as checksumAdd does,
+ * in a single pass
+ */
+uint64_t checksumCopy(uint64_t sum, uint8_t *dst, const uint8_t *src,
+                      size_t length);
+
+/**
+ * Fold a running sum to 16 bits with end-around carry. Only an all-zero
+ * input folds to 0.
+ */
+uint16_t checksumFold(uint64_t sum);
+
+/**
+ * Name of the kernel picked for this CPU (avx2, sse2 or scalar)
+ */
+const char *checksumKernelName();
+
+/**
+ * Switch to the kernel called name, for tests comparing them. Returns false,
+ * leaving the current one in place, if this CPU or build lacks it. Not
+ * thread safe, call it before any checksum is computed concurrently.
+ */
+bool checksumUseKernel(const char *name);
+
+#endif
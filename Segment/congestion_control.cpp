@@ -0,0 +1,127 @@
+#include "congestion_control.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// CUBIC scaling constant and multiplicative decrease factor
+const double CUBIC_C = 0.4;
+const double CUBIC_BETA = 0.7;
+} // namespace
+
+CongestionControl::CongestionControl()
+    : cwnd(INITIAL_CONGESTION_WINDOW), ssthresh(MAX_CONGESTION_WINDOW) {}
+
+uint32_t CongestionControl::getWindow() const {
+  return static_cast<uint32_t>(
+      min(max(cwnd, 1.0), (double)MAX_CONGESTION_WINDOW));
+}
+
+uint32_t CongestionControl::getSlowStartThreshold() const {
+  return static_cast<uint32_t>(ssthresh);
+}
+
+void NewReno::onAck(uint32_t ackedSegments, chrono::microseconds) {
+  double acked = ackedSegments;
+  if (cwnd < ssthresh) {
+    // Exponential growth up to ssthresh, the rest counts as avoidance
+    double used = min(acked, ssthresh - cwnd);
+    cwnd += used;
+    acked -= used;
+  }
+  if (acked > 0) {
+    cwnd += acked / cwnd;
+  }
+  cwnd = min(cwnd, (double)MAX_CONGESTION_WINDOW);
+}
+
+void NewReno::onLoss(uint32_t inFlight) {
+  ssthresh = max((double)inFlight / 2, (double)MIN_SLOW_START_THRESHOLD);
+  cwnd = ssthresh;
+}
+
+void NewReno::onTimeout(uint32_t inFlight) {
+  ssthresh = max((double)inFlight / 2, (double)MIN_SLOW_START_THRESHOLD);
+  cwnd = 1;
+}
+
+Cubic::Cubic()
+    : wMax(0), k(0), origin(0), wEst(0), epochStarted(false) {}
+
+void Cubic::onAck(uint32_t ackedSegments, chrono::microseconds srtt) {
+  double acked = ackedSegments;
+  if (cwnd < ssthresh) {
+    double used = min(acked, ssthresh - cwnd);
+    cwnd += used;
+    acked -= used;
+  }
+  if (acked <= 0) {
+    return;
+  }
+
+  auto now = chrono::steady_clock::now();
+  if (!epochStarted) {
+    epochStarted = true;
+    epochStart = now;
+    if (cwnd < wMax) {
+      k = cbrt((wMax - cwnd) / CUBIC_C);
+      origin = wMax;
+    } else {
+      k = 0;
+      origin = cwnd;
+    }
+    wEst = cwnd;
+  }
+
+  // Target one RTT ahead, as in the RFC
+  double t = chrono::duration<double>(now - epochStart + srtt).count();
+  double target = origin + CUBIC_C * pow(t - k, 3);
+  if (target > cwnd) {
+    cwnd += acked * (target - cwnd) / cwnd;
+  } else {
+    cwnd += acked * 0.01 / cwnd;
+  }
+
+  // TCP-friendly region: at least what Reno with the same beta would reach
+  wEst += acked * 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) / cwnd;
+  cwnd = min(max(cwnd, wEst), (double)MAX_CONGESTION_WINDOW);
+}
+
+void Cubic::reduce() {
+  epochStarted = false;
+  // Fast convergence: release bandwidth sooner when the window keeps falling
+  if (cwnd < wMax) {
+    wMax = cwnd * (1 + CUBIC_BETA) / 2;
+  } else {
+    wMax = cwnd;
+  }
+  ssthresh = max(cwnd * CUBIC_BETA, (double)MIN_SLOW_START_THRESHOLD);
+}
+
+void Cubic::onLoss(uint32_t) {
+  reduce();
+  cwnd = ssthresh;
+}
+
+void Cubic::onTimeout(uint32_t) {
+  reduce();
+  cwnd = 1;
+}
+
+unique_ptr<CongestionControl> makeCongestionControl(CongestionAlgorithm algo) {
+  if (algo == CongestionAlgorithm::CUBIC) {
+    return unique_ptr<CongestionControl>(new Cubic());
+  }
+  return unique_ptr<CongestionControl>(new NewReno());
+}
+
+bool parseCongestionAlgorithm(const string &name, CongestionAlgorithm &algo) {
+  if (name == "newreno" || name == "reno") {
+    algo = CongestionAlgorithm::NEW_RENO;
+    return true;
+  }
+  if (name == "cubic") {
+    algo = CongestionAlgorithm::CUBIC;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,85 @@
+#ifndef congestion_control_h
+#define congestion_control_h
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+using namespace std;
+
+// Initial window in segments (RFC 6928)
+const uint32_t INITIAL_CONGESTION_WINDOW = 10;
+// Never shrink below this many segments on a fast retransmit
+const uint32_t MIN_SLOW_START_THRESHOLD = 2;
+// Upper bound on cwnd so a long loss-free run cannot overflow it
+const uint32_t MAX_CONGESTION_WINDOW = 1u << 20;
+
+enum class CongestionAlgorithm { NEW_RENO, CUBIC };
+
+/**
+ * Sender-side congestion window, counted in segments.
+ *
+ * onAck is called with the number of segments newly acknowledged (cumulative
+ * or selective), onLoss once per loss event detected by duplicate ACKs and
+ * onTimeout when the retransmission timer fires.
+ */
+class CongestionControl {
+protected:
+  double cwnd;
+  double ssthresh;
+
+public:
+  CongestionControl();
+  virtual ~CongestionControl() = default;
+
+  virtual const char *name() const = 0;
+  virtual void onAck(uint32_t ackedSegments, chrono::microseconds srtt) = 0;
+  virtual void onLoss(uint32_t inFlight) = 0;
+  virtual void onTimeout(uint32_t inFlight) = 0;
+
+  uint32_t getWindow() const;
+  uint32_t getSlowStartThreshold() const;
+  bool inSlowStart() const { return cwnd < ssthresh; }
+};
+
+/**
+ * Slow start, additive increase by one segment per RTT and halving on loss
+ * (RFC 6582). Fast recovery bookkeeping lives in the sender.
+ */
+class NewReno : public CongestionControl {
+public:
+  const char *name() const override { return "newreno"; }
+  void onAck(uint32_t ackedSegments, chrono::microseconds srtt) override;
+  void onLoss(uint32_t inFlight) override;
+  void onTimeout(uint32_t inFlight) override;
+};
+
+/**
+ * CUBIC (RFC 8312): after a loss the window follows a cubic function of the
+ * time since that loss, which regrows quickly on paths with a large
+ * bandwidth-delay product. It never grows slower than Reno would.
+ */
+class Cubic : public CongestionControl {
+private:
+  double wMax;
+  double k;
+  double origin;
+  double wEst;
+  bool epochStarted;
+  chrono::steady_clock::time_point epochStart;
+
+  void reduce();
+
+public:
+  Cubic();
+  const char *name() const override { return "cubic"; }
+  void onAck(uint32_t ackedSegments, chrono::microseconds srtt) override;
+  void onLoss(uint32_t inFlight) override;
+  void onTimeout(uint32_t inFlight) override;
+};
+
+unique_ptr<CongestionControl> makeCongestionControl(CongestionAlgorithm algo);
+// Accepts "newreno" and "cubic", returns false for anything else
+bool parseCongestionAlgorithm(const string &name, CongestionAlgorithm &algo);
+
+#endif
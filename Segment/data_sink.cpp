@@ -0,0 +1,62 @@
+#include "data_sink.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+FileSink::FileSink(const string &path)
+    : fd(-1), reserved(0), flushed(0), written(0) {
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+FileSink::~FileSink() { close(); }
+
+bool FileSink::write(uint64_t offset, const uint8_t *data, size_t length) {
+  if (fd < 0) {
+    return false;
+  }
+  uint64_t end = offset + length;
+  if (end > reserved) {
+    // KEEP_SIZE reserves blocks without growing the file, filesystems that
+    // cannot do it simply allocate on write
+    uint64_t target = max(end, reserved + SINK_PREALLOCATE_SIZE);
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, reserved, target - reserved);
+    reserved = target;
+  }
+
+  while (length > 0) {
+    ssize_t done = pwrite(fd, data, length, offset);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    data += done;
+    offset += done;
+    length -= done;
+  }
+  written = max(written, end);
+
+  if (written - flushed >= SINK_WRITEBACK_SIZE) {
+    sync_file_range(fd, flushed, written - flushed, SYNC_FILE_RANGE_WRITE);
+    flushed = written;
+  }
+  return true;
+}
+
+bool FileSink::close() {
+  if (fd < 0) {
+    return true;
+  }
+  // Drop whatever was reserved past the last byte
+  bool ok = ftruncate(fd, written) == 0;
+  ok = ::close(fd) == 0 && ok;
+  fd = -1;
+  return ok;
+}
+
+bool StreamSink::write(uint64_t offset, const uint8_t *data, size_t length) {
+  lock_guard<mutex> lock(targetMutex);
+  return target.write(base + offset, data, length);
+}
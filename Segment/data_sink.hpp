@@ -0,0 +1,69 @@
+#ifndef data_sink_h
+#define data_sink_h
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+using namespace std;
+
+// Disk space reserved ahead of the write position, and how often written
+// data is handed to the kernel for writeback
+const uint64_t SINK_PREALLOCATE_SIZE = 16 * 1024 * 1024;
+const uint64_t SINK_WRITEBACK_SIZE = 8 * 1024 * 1024;
+
+/**
+ * Where a receiver puts payload bytes. Writes are positional, so segments
+ * can be stored in any order once their offset is known.
+ */
+class DataSink {
+public:
+  virtual ~DataSink() = default;
+
+  // Store length bytes at offset, false on I/O error
+  virtual bool write(uint64_t offset, const uint8_t *data, size_t length) = 0;
+};
+
+/**
+ * Sink that pwrites straight into a file. Space is preallocated in large
+ * steps to keep the file contiguous, and writeback starts while the transfer
+ * is still running instead of piling up dirty pages until close.
+ */
+class FileSink : public DataSink {
+private:
+  int fd;
+  uint64_t reserved;
+  uint64_t flushed;
+  uint64_t written;
+
+public:
+  explicit FileSink(const string &path);
+  ~FileSink() override;
+  FileSink(const FileSink &) = delete;
+  FileSink &operator=(const FileSink &) = delete;
+
+  bool isOpen() const { return fd >= 0; }
+  uint64_t size() const { return written; }
+  bool write(uint64_t offset, const uint8_t *data, size_t length) override;
+  bool close();
+};
+
+/**
+ * One stream's part of a sink shared by several streams. Writes land at
+ * base + offset, and the shared mutex keeps the target's bookkeeping
+ * consistent while streams write concurrently.
+ */
+class StreamSink : public DataSink {
+private:
+  DataSink &target;
+  mutex &targetMutex;
+  uint64_t base;
+
+public:
+  StreamSink(DataSink &target, mutex &targetMutex, uint64_t base)
+      : target(target), targetMutex(targetMutex), base(base) {}
+
+  bool write(uint64_t offset, const uint8_t *data, size_t length) override;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "data_source.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+bool MemorySource::read(uint64_t offset, const iovec *iov, int count) {
+  for (int i = 0; i < count; i++) {
+    if (offset + iov[i].iov_len > length) {
+      return false;
+    }
+    memcpy(iov[i].iov_base, data + offset, iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+  return true;
+}
+
+namespace {
+// Open FileSources per file, concurrent sessions each open their own
+mutex openSourcesMutex;
+map<pair<uint64_t, uint64_t>, int> openSources;
+} // namespace
+
+FileSource::FileSource(const string &path) : fd(-1), length(0) {
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == 0) {
+    length = static_cast<uint64_t>(info.st_size);
+    identity = make_pair(static_cast<uint64_t>(info.st_dev),
+                         static_cast<uint64_t>(info.st_ino));
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  lock_guard<mutex> lock(openSourcesMutex);
+  openSources[identity]++;
+}
+
+FileSource::~FileSource() {
+  if (fd >= 0) {
+    close(fd);
+    lock_guard<mutex> lock(openSourcesMutex);
+    if (--openSources[identity] == 0) {
+      openSources.erase(identity);
+    }
+  }
+}
+
+bool FileSource::read(uint64_t offset, const iovec *iov, int count) {
+  if (fd < 0) {
+    return false;
+  }
+  // preadv may stop short, continue from wherever it did
+  vector<iovec> pending(iov, iov + count);
+  size_t first = 0;
+  while (first < pending.size()) {
+    int chunk = static_cast<int>(min<size_t>(pending.size() - first, IOV_MAX));
+    ssize_t got = preadv(fd, pending.data() + first, chunk, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    offset += got;
+    while (first < pending.size() && (size_t)got >= pending[first].iov_len) {
+      got -= pending[first].iov_len;
+      first++;
+    }
+    if (got > 0) {
+      pending[first].iov_base =
+          static_cast<uint8_t *>(pending[first].iov_base) + got;
+      pending[first].iov_len -= got;
+    }
+  }
+  return true;
+}
+
+void FileSource::willNeed(uint64_t offset, uint64_t length) {
+  if (fd >= 0) {
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+  }
+}
+
+void FileSource::doneWith(uint64_t offset, uint64_t length) {
+  if (fd < 0) {
+    return;
+  }
+  // Another session may still have to send these pages
+  {
+    lock_guard<mutex> lock(openSourcesMutex);
+    if (openSources[identity] > 1) {
+      return;
+    }
+  }
+  posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+RangeSource::RangeSource(DataSource &inner, uint64_t offset, uint64_t length)
+    : inner(inner), base(min(offset, inner.size())),
+      length(min(length, inner.size() - base)) {}
+
+bool RangeSource::read(uint64_t offset, const iovec *iov, int count) {
+  return inner.read(base + offset, iov, count);
+}
+
+void RangeSource::willNeed(uint64_t offset, uint64_t length) {
+  inner.willNeed(base + offset, length);
+}
+
+void RangeSource::doneWith(uint64_t offset, uint64_t length) {
+  inner.doneWith(base + offset, length);
+}
+
+void splitRange(uint64_t size, uint32_t index, uint32_t count,
+                uint64_t &offset, uint64_t &length) {
+  const uint64_t align = 4096;
+  uint64_t part = (size + count - 1) / count;
+  part = (part + align - 1) / align * align;
+  offset = min(size, part * index);
+  length = min(size - offset, part);
+}
@@ -0,0 +1,97 @@
+#ifndef data_source_h
+#define data_source_h
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <sys/uio.h>
+using namespace std;
+
+/**
+ * Bytes a SegmentHandler cuts into segments. Segments are built lazily as the
+ * window advances, so a source is read piecewise and in order, with the
+ * occasional step back for a retransmission.
+ */
+class DataSource {
+public:
+  virtual ~DataSource() = default;
+
+  virtual uint64_t size() const = 0;
+  // Scatter length bytes starting at offset into iov, false on I/O error
+  virtual bool read(uint64_t offset, const iovec *iov, int count) = 0;
+  // Hints about what will be read next and what is no longer needed
+  virtual void willNeed(uint64_t, uint64_t) {}
+  virtual void doneWith(uint64_t, uint64_t) {}
+};
+
+/**
+ * Source over bytes already in memory (user input), the caller keeps them
+ * alive for the whole transfer.
+ */
+class MemorySource : public DataSource {
+private:
+  const uint8_t *data;
+  uint64_t length;
+
+public:
+  MemorySource(const uint8_t *data, uint64_t length)
+      : data(data), length(length) {}
+
+  uint64_t size() const override { return length; }
+  bool read(uint64_t offset, const iovec *iov, int count) override;
+};
+
+/**
+ * Source that preads a file on demand. Only the segments in flight are
+ * resident, the kernel is told to read ahead and to drop what was acked.
+ * Pages are only dropped while this is the file's one open source, other
+ * sessions sending the same file still need them.
+ */
+class FileSource : public DataSource {
+private:
+  int fd;
+  uint64_t length;
+  // (device, inode), the key of the process wide count of open sources
+  pair<uint64_t, uint64_t> identity;
+
+public:
+  explicit FileSource(const string &path);
+  ~FileSource() override;
+  FileSource(const FileSource &) = delete;
+  FileSource &operator=(const FileSource &) = delete;
+
+  bool isOpen() const { return fd >= 0; }
+  uint64_t size() const override { return length; }
+  bool read(uint64_t offset, const iovec *iov, int count) override;
+  void willNeed(uint64_t offset, uint64_t length) override;
+  void doneWith(uint64_t offset, uint64_t length) override;
+};
+
+/**
+ * length bytes of another source starting at offset, the part of the content
+ * one stream carries. The inner source must outlive this one.
+ */
+class RangeSource : public DataSource {
+private:
+  DataSource &inner;
+  uint64_t base;
+  uint64_t length;
+
+public:
+  RangeSource(DataSource &inner, uint64_t offset, uint64_t length);
+
+  uint64_t size() const override { return length; }
+  bool read(uint64_t offset, const iovec *iov, int count) override;
+  void willNeed(uint64_t offset, uint64_t length) override;
+  void doneWith(uint64_t offset, uint64_t length) override;
+};
+
+/**
+ * Split size bytes into count nearly equal, page aligned parts and return
+ * where part index starts and how long it is. Trailing parts of a small
+ * input may be empty.
+ */
+void splitRange(uint64_t size, uint32_t index, uint32_t count,
+                uint64_t &offset, uint64_t &length);
+
+#endif
@@ -0,0 +1,166 @@
+#include "payload_allocator.hpp"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Each buffer is preceded by a tag saying where it came from, padded so the
+// payload stays 16-byte aligned
+const size_t TAG_SIZE = 16;
+
+enum BlockKind : uint32_t {
+  SLAB_BLOCK = 0x51AB,
+  JUMBO_SLAB_BLOCK = 0x51AC,
+  HEAP_BLOCK = 0x4EA9
+};
+
+// Slab size classes, indexed by kind - SLAB_BLOCK
+const size_t SIZE_CLASSES = 2;
+const size_t CLASS_BLOCK_SIZE[SIZE_CLASSES] = {PAYLOAD_BLOCK_SIZE,
+                                               PAYLOAD_JUMBO_BLOCK_SIZE};
+
+inline uint32_t &kindOf(uint8_t *payload) {
+  return *reinterpret_cast<uint32_t *>(payload - TAG_SIZE);
+}
+
+/**
+ * Free slab blocks of one size shared by all threads. Slabs are never
+ * returned to the system, so memory stays at the peak number of payloads
+ * alive at once.
+ */
+class Depot {
+private:
+  mutex mtx;
+  size_t sizeClass;
+  vector<unique_ptr<uint8_t[]>> slabs;
+  vector<uint8_t *> freeBlocks;
+
+  void grow() {
+    size_t stride = TAG_SIZE + CLASS_BLOCK_SIZE[sizeClass];
+    slabs.emplace_back(new uint8_t[stride * PAYLOAD_SLAB_BLOCKS]);
+    uint8_t *slab = slabs.back().get();
+    for (uint32_t i = 0; i < PAYLOAD_SLAB_BLOCKS; i++) {
+      uint8_t *payload = slab + i * stride + TAG_SIZE;
+      kindOf(payload) = SLAB_BLOCK + sizeClass;
+      freeBlocks.push_back(payload);
+    }
+  }
+
+public:
+  explicit Depot(size_t sizeClass) : sizeClass(sizeClass) {}
+
+  void take(vector<uint8_t *> &into, size_t count) {
+    lock_guard<mutex> lock(mtx);
+    while (freeBlocks.size() < count) {
+      grow();
+    }
+    into.insert(into.end(), freeBlocks.end() - count, freeBlocks.end());
+    freeBlocks.resize(freeBlocks.size() - count);
+  }
+
+  void give(vector<uint8_t *> &from, size_t count) {
+    lock_guard<mutex> lock(mtx);
+    freeBlocks.insert(freeBlocks.end(), from.end() - count, from.end());
+    from.resize(from.size() - count);
+  }
+
+  // Single blocks for threads whose cache is already gone
+  uint8_t *takeOne() {
+    lock_guard<mutex> lock(mtx);
+    if (freeBlocks.empty()) {
+      grow();
+    }
+    uint8_t *payload = freeBlocks.back();
+    freeBlocks.pop_back();
+    return payload;
+  }
+
+  void giveOne(uint8_t *payload) {
+    lock_guard<mutex> lock(mtx);
+    freeBlocks.push_back(payload);
+  }
+};
+
+// Threads may still free payloads while the process exits, so the depots
+// are left for the OS to reclaim instead of being destroyed
+Depot &depot(size_t sizeClass) {
+  static Depot *shared[SIZE_CLASSES] = {new Depot(0), new Depot(1)};
+  return *shared[sizeClass];
+}
+
+enum CacheState : uint8_t { CACHE_UNUSED, CACHE_ALIVE, CACHE_DESTROYED };
+
+// Plain thread_local without a destructor, so it can still be read while the
+// thread or process tears down after cache is gone. Segments freed from
+// other destructors then go straight to the depots.
+thread_local CacheState cacheState = CACHE_UNUSED;
+
+/**
+ * Blocks owned by one thread, handed back to the depots when the thread ends
+ */
+struct ThreadCache {
+  vector<uint8_t *> blocks[SIZE_CLASSES];
+
+  ThreadCache() {
+    for (auto &cached : blocks) {
+      cached.reserve(PAYLOAD_CACHE_BATCH * 2);
+    }
+    cacheState = CACHE_ALIVE;
+  }
+  ~ThreadCache() {
+    cacheState = CACHE_DESTROYED;
+    for (size_t i = 0; i < SIZE_CLASSES; i++) {
+      if (!blocks[i].empty()) {
+        depot(i).give(blocks[i], blocks[i].size());
+      }
+    }
+  }
+};
+
+thread_local ThreadCache cache;
+
+} // namespace
+
+uint8_t *allocatePayload(size_t size) {
+  if (size == 0) {
+    return nullptr;
+  }
+  if (size > PAYLOAD_JUMBO_BLOCK_SIZE) {
+    uint8_t *payload = new uint8_t[TAG_SIZE + size] + TAG_SIZE;
+    kindOf(payload) = HEAP_BLOCK;
+    return payload;
+  }
+  size_t sizeClass = size > PAYLOAD_BLOCK_SIZE ? 1 : 0;
+  if (cacheState == CACHE_DESTROYED) {
+    return depot(sizeClass).takeOne();
+  }
+  vector<uint8_t *> &cached = cache.blocks[sizeClass];
+  if (cached.empty()) {
+    depot(sizeClass).take(cached, PAYLOAD_CACHE_BATCH);
+  }
+  uint8_t *payload = cached.back();
+  cached.pop_back();
+  return payload;
+}
+
+void freePayload(uint8_t *payload) {
+  if (payload == nullptr) {
+    return;
+  }
+  uint32_t kind = kindOf(payload);
+  if (kind == HEAP_BLOCK) {
+    delete[] (payload - TAG_SIZE);
+    return;
+  }
+  size_t sizeClass = kind - SLAB_BLOCK;
+  if (cacheState == CACHE_DESTROYED) {
+    depot(sizeClass).giveOne(payload);
+    return;
+  }
+  vector<uint8_t *> &cached = cache.blocks[sizeClass];
+  cached.push_back(payload);
+  if (cached.size() >= PAYLOAD_CACHE_BATCH * 2) {
+    depot(sizeClass).give(cached, PAYLOAD_CACHE_BATCH);
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef payload_allocator_h
+#define payload_allocator_h
+
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+
+// Every slab block holds this many payload bytes, enough for a whole segment
+// on the wire. Payloads up to the jumbo block size come from a second set of
+// slabs, larger requests go to the heap.
+const uint32_t PAYLOAD_BLOCK_SIZE = 1536;
+const uint32_t PAYLOAD_JUMBO_BLOCK_SIZE = 9216;
+// Blocks carved out of the heap at a time when the free list runs dry
+const uint32_t PAYLOAD_SLAB_BLOCKS = 256;
+// Blocks a thread moves between its cache and the shared free list at once,
+// the cache holds at most twice that
+const uint32_t PAYLOAD_CACHE_BATCH = 64;
+
+/**
+ * Payload buffer of at least size bytes, nullptr for size 0. Blocks come from
+ * fixed-size slabs through a per-thread cache, one per block size, so the
+ * common case takes no lock and never touches malloc.
+ */
+uint8_t *allocatePayload(size_t size);
+
+/**
+ * Give back a buffer from allocatePayload, from any thread. nullptr is
+ * ignored.
+ */
+void freePayload(uint8_t *payload);
+
+#endif
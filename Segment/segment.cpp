@@ -1,4 +1,5 @@
 #include "segment.hpp"
+#include "checksum.hpp"
 #include <cstdint>
 #include <string>  // Required for std::string
 #include <utility> // Required for std::pair
@@ -98,56 +99,36 @@ Segment finAck(uint32_t seqNum, uint32_t ackNum) {
   return segment;
 }
 
+/**
+ * Running checksum over the header fields and options, folding is deferred
+ * until the payload has been added
+ */
+static uint64_t headerChecksum(const Segment &segment) {
+  uint64_t sum = segment.sourcePort;
+  sum += segment.destPort;
+  sum += segment.seqNum >> 16;    // High 16 bits of seqNum
+  sum += segment.seqNum & 0xFFFF; // Low 16 bits of seqNum
+  // ackNum and the flags are not covered
+  sum += segment.window;
+  sum += segment.urgPointer;
+
+  // Options are padded to whole words, so they sum as 16-bit pairs
+  return checksumAdd(sum, segment.options, headerLength(segment) - HEADER_SIZE);
+}
+
 /**
  * Calculate the checksum for a given Segment
  */
-uint16_t calculateChecksum(Segment &segment) {
-  uint32_t sum = 0;
-
-  // Helper function to add 16-bit words to the sum and carry the overflow
-  auto addToSum = [&](uint16_t word) {
-    sum += word;
-    if (sum > 0xFFFF) {         // if there's an overflow
-      sum = (sum & 0xFFFF) + 1; // carry the overflow
-    }
-  };
-
-  // Add the fields from the Segment structure
-  addToSum(segment.sourcePort);
-  addToSum(segment.destPort);
-  addToSum(segment.seqNum >> 16);    // High 16 bits of seqNum
-  addToSum(segment.seqNum & 0xFFFF); // Low 16 bits of seqNum
-  // addToSum(segment.ackNum >> 16);    // High 16 bits of ackNum
-  // addToSum(segment.ackNum & 0xFFFF); // Low 16 bits of ackNum
-  // addToSum((segment.data_offset << 12) | (segment.reserved << 8) |
-  //          *((uint16_t *)&segment.flags));
-
-  addToSum(segment.window);
-  addToSum(segment.urgPointer);
-
-  // Add the payload (if it exists)
-  if (segment.payload != nullptr && segment.payloadSize > 0) {
-    uint8_t *payload = segment.payload;
-    uint32_t remaining = segment.payloadSize;
-
-    // Process the payload in 16-bit chunks
-    while (remaining > 1) {
-      uint16_t word = (payload[0] << 8) + payload[1];
-      addToSum(word);
-      payload += 2;
-      remaining -= 2;
-    }
+uint16_t calculateChecksum(const Segment &segment) {
+  uint64_t sum = headerChecksum(segment);
 
-    // Handle the case if there's an odd byte left
-    if (remaining > 0) {
-      uint16_t word = (payload[0] << 8);
-      addToSum(word);
-    }
+  // Add the payload (if it exists), an odd last byte is padded with zero
+  if (segment.payload != nullptr && segment.payloadSize > 0) {
+    sum = checksumAdd(sum, segment.payload, segment.payloadSize);
   }
 
   // Final 1's complement of the sum
-  sum = ~sum;
-  return static_cast<uint16_t>(sum);
+  return static_cast<uint16_t>(~checksumFold(sum));
 }
 // uint16_t calculateChecksum(Segment &segment) {
 //   // std::cout << "calc: " << std::endl;
@@ -201,7 +182,7 @@ void updateChecksum(Segment &segment) {
 /**
  * Verify if a Segment has a valid checksum
  */
-bool isValidChecksum(Segment segment) {
+bool isValidChecksum(const Segment &segment) {
   uint16_t curChecksum = segment.checksum;
   uint16_t computed = calculateChecksum(segment);
 
@@ -219,7 +200,7 @@ Segment createSegment(const std::string &data, uint16_t sport, uint16_t dport) {
   if (segment.payloadSize == 0) {
     segment.payload = nullptr;
   } else {
-    segment.payload = new uint8_t[segment.payloadSize];
+    segment.payload = allocatePayload(segment.payloadSize);
     std::memcpy(segment.payload, data.c_str(), segment.payloadSize);
   }
 
@@ -276,6 +257,10 @@ bool operator==(const Segment &lhs, const Segment &rhs) {
     return false;
   }
 
+  if (memcmp(lhs.options, rhs.options, headerLength(lhs) - HEADER_SIZE) != 0) {
+    return false;
+  }
+
   // Compare payload data
   if (lhs.payload != nullptr && rhs.payload != nullptr) {
     if (std::memcmp(lhs.payload, rhs.payload, lhs.payloadSize) != 0) {
@@ -289,38 +274,205 @@ bool operator==(const Segment &lhs, const Segment &rhs) {
 }
 
 Segment copySegment(const Segment &source) {
-  Segment copy = {};
-
-  copy.sourcePort = source.sourcePort;
-  copy.destPort = source.destPort;
-  copy.seqNum = source.seqNum;
-  copy.ackNum = source.ackNum;
-  copy.data_offset = source.data_offset;
-  copy.reserved = source.reserved;
-  copy.flags.cwr = source.flags.cwr;
-  copy.flags.ece = source.flags.ece;
-  copy.flags.urg = source.flags.urg;
-  copy.flags.ack = source.flags.ack;
-  copy.flags.psh = source.flags.psh;
-  copy.flags.rst = source.flags.rst;
-  copy.flags.syn = source.flags.syn;
-  copy.flags.fin = source.flags.fin;
-  copy.window = source.window;
-  copy.checksum = source.checksum;
-  copy.urgPointer = source.urgPointer;
-  copy.payloadSize = source.payloadSize;
+  Segment copy;
+  copy.copyHeader(source);
 
   if (source.payload != nullptr && source.payloadSize > 0) {
-    copy.payload = new uint8_t[source.payloadSize];
+    copy.payload = allocatePayload(source.payloadSize);
     memcpy(copy.payload, source.payload, source.payloadSize);
-  } else {
-    copy.payload = nullptr;
   }
 
   return copy;
 }
 
-void encodeSegment(const Segment &segment, uint8_t *buffer) {
+Segment borrowSegment(const Segment &source) {
+  Segment view;
+  view.copyHeader(source);
+  view.payload = source.payload;
+  view.ownsPayload = false;
+  return view;
+}
+
+uint32_t headerLength(const Segment &segment) {
+  return segment.data_offset > 6 ? segment.data_offset * 4 : HEADER_SIZE;
+}
+
+bool addOption(Segment &segment, uint8_t kind, const uint8_t *data,
+               uint8_t length) {
+  // Walk to the first END, padding bytes after it are reused
+  uint32_t used = 0;
+  uint32_t optionsSize = headerLength(segment) - HEADER_SIZE;
+  while (used < optionsSize && segment.options[used] != OPTION_END) {
+    if (segment.options[used] == OPTION_NOP) {
+      used++;
+      continue;
+    }
+    // A malformed option leaves no safe place to append after it
+    if (used + 1 >= optionsSize || segment.options[used + 1] < 2 ||
+        used + segment.options[used + 1] > optionsSize) {
+      return false;
+    }
+    used += segment.options[used + 1];
+  }
+
+  uint32_t needed = used + 2 + length;
+  if (needed > MAX_OPTIONS_SIZE) {
+    return false;
+  }
+  segment.options[used] = kind;
+  segment.options[used + 1] = 2 + length;
+  memcpy(segment.options + used + 2, data, length);
+
+  uint32_t padded = (needed + 3) & ~3u;
+  memset(segment.options + needed, OPTION_END, padded - needed);
+  segment.data_offset = 6 + padded / 4;
+  return true;
+}
+
+const uint8_t *findOption(const Segment &segment, uint8_t kind,
+                          uint8_t &length) {
+  uint32_t optionsSize = headerLength(segment) - HEADER_SIZE;
+  uint32_t i = 0;
+  while (i < optionsSize && segment.options[i] != OPTION_END) {
+    if (segment.options[i] == OPTION_NOP) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= optionsSize || segment.options[i + 1] < 2 ||
+        i + segment.options[i + 1] > optionsSize) {
+      break;
+    }
+    if (segment.options[i] == kind) {
+      length = segment.options[i + 1] - 2;
+      return segment.options + i + 2;
+    }
+    i += segment.options[i + 1];
+  }
+  return nullptr;
+}
+
+void setSackBlocks(Segment &segment, const vector<SackBlock> &blocks) {
+  uint8_t data[MAX_SACK_BLOCKS * 8];
+  uint32_t count = min<uint32_t>(blocks.size(), MAX_SACK_BLOCKS);
+  if (count == 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(data + i * 8, &blocks[i].start, 4);
+    memcpy(data + i * 8 + 4, &blocks[i].end, 4);
+  }
+  // Other options may leave room for fewer blocks, the newest ones go first
+  while (count > 0 && !addOption(segment, OPTION_SACK, data, count * 8)) {
+    count--;
+  }
+}
+
+vector<SackBlock> getSackBlocks(const Segment &segment) {
+  vector<SackBlock> blocks;
+  uint8_t length = 0;
+  const uint8_t *data = findOption(segment, OPTION_SACK, length);
+  if (data == nullptr) {
+    return blocks;
+  }
+  for (uint32_t i = 0; i + 8 <= length; i += 8) {
+    SackBlock block;
+    memcpy(&block.start, data + i, 4);
+    memcpy(&block.end, data + i + 4, 4);
+    blocks.push_back(block);
+  }
+  return blocks;
+}
+
+void setWindowScale(Segment &segment, uint8_t shift) {
+  addOption(segment, OPTION_WINDOW_SCALE, &shift, 1);
+}
+
+bool getWindowScale(const Segment &segment, uint8_t &shift) {
+  uint8_t length = 0;
+  const uint8_t *data = findOption(segment, OPTION_WINDOW_SCALE, length);
+  if (data == nullptr || length != 1) {
+    return false;
+  }
+  shift = min(*data, MAX_WINDOW_SCALE);
+  return true;
+}
+
+void setMaxSegmentSize(Segment &segment, uint32_t payloadSize) {
+  uint16_t value = static_cast<uint16_t>(min<uint32_t>(payloadSize, 0xFFFF));
+  addOption(segment, OPTION_MSS, reinterpret_cast<const uint8_t *>(&value),
+            sizeof(value));
+}
+
+bool getMaxSegmentSize(const Segment &segment, uint32_t &payloadSize) {
+  uint8_t length = 0;
+  const uint8_t *data = findOption(segment, OPTION_MSS, length);
+  if (data == nullptr || length != 2) {
+    return false;
+  }
+  uint16_t value;
+  memcpy(&value, data, sizeof(value));
+  payloadSize = value;
+  return true;
+}
+
+Segment pathProbe(uint32_t probeId, uint32_t seqNum,
+                  uint32_t datagramPayload) {
+  Segment segment;
+  segment.seqNum = seqNum;
+  // Flagged so that no filter mistakes the empty-looking header for a
+  // broadcast
+  segment.flags.urg = 1;
+  setPathProbe(segment, probeId);
+  // The option counts towards the size being probed
+  uint32_t optionBytes = headerLength(segment) - HEADER_SIZE;
+  segment.payloadSize =
+      datagramPayload > optionBytes ? datagramPayload - optionBytes : 0;
+  segment.payload = allocatePayload(segment.payloadSize);
+  if (segment.payload != nullptr) {
+    memset(segment.payload, 0, segment.payloadSize);
+  }
+  updateChecksum(segment);
+  return segment;
+}
+
+void setPathProbe(Segment &segment, uint32_t probeId) {
+  addOption(segment, OPTION_PATH_PROBE,
+            reinterpret_cast<const uint8_t *>(&probeId), sizeof(probeId));
+}
+
+bool getPathProbe(const Segment &segment, uint32_t &probeId) {
+  uint8_t length = 0;
+  const uint8_t *data = findOption(segment, OPTION_PATH_PROBE, length);
+  if (data == nullptr || length != sizeof(probeId)) {
+    return false;
+  }
+  memcpy(&probeId, data, sizeof(probeId));
+  return true;
+}
+
+void setStreamRange(Segment &segment, const StreamRange &range) {
+  uint8_t data[18];
+  data[0] = range.index;
+  data[1] = range.count;
+  memcpy(data + 2, &range.offset, 8);
+  memcpy(data + 10, &range.length, 8);
+  addOption(segment, OPTION_STREAM, data, sizeof(data));
+}
+
+bool getStreamRange(const Segment &segment, StreamRange &range) {
+  uint8_t length = 0;
+  const uint8_t *data = findOption(segment, OPTION_STREAM, length);
+  if (data == nullptr || length != 18 || data[1] == 0 || data[0] >= data[1]) {
+    return false;
+  }
+  range.index = data[0];
+  range.count = data[1];
+  memcpy(&range.offset, data + 2, 8);
+  memcpy(&range.length, data + 10, 8);
+  return true;
+}
+
+void encodeHeader(const Segment &segment, uint8_t *buffer) {
   memcpy(buffer, &segment.sourcePort, sizeof(segment.sourcePort));
   memcpy(buffer + 2, &segment.destPort, sizeof(segment.destPort));
   memcpy(buffer + 4, &segment.seqNum, sizeof(segment.seqNum));
@@ -333,11 +485,21 @@ void encodeSegment(const Segment &segment, uint8_t *buffer) {
   memcpy(buffer + 16, &segment.checksum, sizeof(segment.checksum));
   memcpy(buffer + 18, &segment.urgPointer, sizeof(segment.urgPointer));
   memcpy(buffer + 20, &segment.payloadSize, sizeof(segment.payloadSize));
-  memcpy(buffer + 24, segment.payload, segment.payloadSize);
+  memcpy(buffer + 24, segment.options, headerLength(segment) - HEADER_SIZE);
 }
 
-Segment decodeSegment(const uint8_t *buffer, uint32_t length) {
-  Segment segment = {};
+void encodeSegment(const Segment &segment, uint8_t *buffer) {
+  encodeHeader(segment, buffer);
+  uint64_t sum = headerChecksum(segment);
+  if (segment.payload != nullptr && segment.payloadSize > 0) {
+    sum = checksumCopy(sum, buffer + headerLength(segment), segment.payload,
+                       segment.payloadSize);
+  }
+  uint16_t checksum = static_cast<uint16_t>(~checksumFold(sum));
+  memcpy(buffer + 16, &checksum, sizeof(checksum));
+}
+
+static void decodeHeader(const uint8_t *buffer, Segment &segment) {
   memcpy(&segment.sourcePort, buffer, sizeof(segment.sourcePort));
   memcpy(&segment.destPort, buffer + 2, sizeof(segment.destPort));
   memcpy(&segment.seqNum, buffer + 4, sizeof(segment.seqNum));
@@ -351,14 +513,80 @@ Segment decodeSegment(const uint8_t *buffer, uint32_t length) {
   memcpy(&segment.checksum, buffer + 16, sizeof(segment.checksum));
   memcpy(&segment.urgPointer, buffer + 18, sizeof(segment.urgPointer));
   memcpy(&segment.payloadSize, buffer + 20, sizeof(segment.payloadSize));
+}
 
-  if (segment.payloadSize == 0) {
+/**
+ * Decode the header and options, false when length cannot hold them plus
+ * the advertised payload
+ */
+static bool decodeBounded(const uint8_t *buffer, uint32_t length,
+                          Segment &segment) {
+  if (length < HEADER_SIZE) {
+    return false;
+  }
+  decodeHeader(buffer, segment);
+  if (segment.data_offset < 6 || headerLength(segment) > length) {
+    return false;
+  }
+  memcpy(segment.options, buffer + HEADER_SIZE,
+         headerLength(segment) - HEADER_SIZE);
+  return segment.payloadSize <= length - headerLength(segment);
+}
+
+bool decodeSegment(const uint8_t *buffer, uint32_t length, Segment &segment) {
+  segment = Segment();
+  if (!decodeBounded(buffer, length, segment)) {
+    return false;
+  }
+
+  uint64_t sum = headerChecksum(segment);
+  if (segment.payloadSize > 0) {
+    segment.payload = allocatePayload(segment.payloadSize);
+    sum = checksumCopy(sum, segment.payload, buffer + headerLength(segment),
+                       segment.payloadSize);
+  }
+  if (static_cast<uint16_t>(~checksumFold(sum)) != segment.checksum) {
+    freePayload(segment.payload);
     segment.payload = nullptr;
-  } else {
-    segment.payload = new uint8_t[segment.payloadSize];
-    memcpy(segment.payload, buffer + 24, segment.payloadSize);
+    segment.payloadSize = 0;
+    return false;
   }
-  return segment;
+  return true;
+}
+
+bool isValidSegment(const uint8_t *buffer, uint32_t length) {
+  Segment header;
+  if (!decodeBounded(buffer, length, header)) {
+    return false;
+  }
+  uint64_t sum = checksumAdd(headerChecksum(header),
+                             buffer + headerLength(header), header.payloadSize);
+  return static_cast<uint16_t>(~checksumFold(sum)) == header.checksum;
+}
+
+bool decodeSegmentView(const RecvBufferRef &buffer, uint32_t length,
+                       SegmentView &view) {
+  return decodeSegmentView(buffer, 0, length, view);
+}
+
+bool decodeSegmentView(const RecvBufferRef &buffer, uint32_t offset,
+                       uint32_t length, SegmentView &view) {
+  const uint8_t *datagram = buffer.data() + offset;
+  if (!decodeBounded(datagram, length, view.segment)) {
+    return false;
+  }
+  uint32_t payloadOffset = offset + headerLength(view.segment);
+  uint64_t sum = checksumAdd(headerChecksum(view.segment),
+                             buffer.data() + payloadOffset,
+                             view.segment.payloadSize);
+  if (static_cast<uint16_t>(~checksumFold(sum)) != view.segment.checksum) {
+    return false;
+  }
+  view.segment.payload =
+      view.segment.payloadSize == 0 ? nullptr : buffer.data() + payloadOffset;
+  view.segment.ownsPayload = false;
+  view.buffer = buffer;
+  return true;
 }
 
 uint8_t getFlags8(const Segment *segment) {
@@ -1,6 +1,8 @@
 #ifndef segment_h
 #define segment_h
 
+#include "buffer_pool.hpp"
+#include "payload_allocator.hpp"
 #include <cstdint>
 #include <cstring>
 #include <iomanip>
@@ -10,6 +12,9 @@
 #include <vector>
 using namespace std;
 
+// data_offset is 4 bits of 32-bit words, so at most 60 - 24 bytes of options
+const uint32_t MAX_OPTIONS_SIZE = 36;
+
 struct Segment
 {
   uint16_t sourcePort;
@@ -40,30 +45,75 @@ struct Segment
   uint16_t checksum;
   uint16_t urgPointer;
   uint32_t payloadSize;
+  // Option bytes, (data_offset - 6) * 4 of them are in use
+  uint8_t options[MAX_OPTIONS_SIZE];
   uint8_t *payload;
+  // False when payload points into memory owned elsewhere, such as a receive
+  // slot, otherwise the segment frees it
+  bool ownsPayload;
+
   Segment()
       : sourcePort(0), destPort(0), seqNum(0), ackNum(0), window(0),
-        checksum(0), urgPointer(0), payloadSize(0), payload(nullptr)
+        checksum(0), urgPointer(0), payloadSize(0), payload(nullptr),
+        ownsPayload(true)
   {
     data_offset = 6;
     reserved = 0;
     memset(&flags, 0, sizeof(flags));
   }
 
-  Segment(const Segment &other)
-      : sourcePort(other.sourcePort), destPort(other.destPort),
-        seqNum(other.seqNum), ackNum(other.ackNum), window(other.window),
-        checksum(other.checksum), urgPointer(other.urgPointer),
-        payloadSize(other.payloadSize), payload(nullptr)
+  ~Segment()
+  {
+    if (ownsPayload)
+    {
+      freePayload(payload);
+    }
+  }
+
+  // Payloads have a single owner, use copySegment for an explicit deep copy
+  Segment(const Segment &) = delete;
+  Segment &operator=(const Segment &) = delete;
+
+  Segment(Segment &&other) noexcept
+      : payload(other.payload), ownsPayload(other.ownsPayload)
+  {
+    copyHeader(other);
+    other.payload = nullptr;
+    other.payloadSize = 0;
+    other.ownsPayload = true;
+  }
+
+  Segment &operator=(Segment &&other) noexcept
   {
-    if (other.payload != nullptr && other.payloadSize > 0)
+    if (this != &other)
     {
-      payload = new uint8_t[other.payloadSize];
-      std::copy(other.payload, other.payload + other.payloadSize, payload);
+      if (ownsPayload)
+      {
+        freePayload(payload);
+      }
+      copyHeader(other);
+      payload = other.payload;
+      ownsPayload = other.ownsPayload;
+      other.payload = nullptr;
+      other.payloadSize = 0;
+      other.ownsPayload = true;
     }
+    return *this;
+  }
 
+  // Every field except the payload pointer and its ownership
+  void copyHeader(const Segment &other)
+  {
+    sourcePort = other.sourcePort;
+    destPort = other.destPort;
+    seqNum = other.seqNum;
+    ackNum = other.ackNum;
     data_offset = other.data_offset;
     reserved = other.reserved;
+    if (data_offset > 6)
+    {
+      memcpy(options, other.options, (data_offset - 6) * 4);
+    }
     flags.cwr = other.flags.cwr;
     flags.ece = other.flags.ece;
     flags.urg = other.flags.urg;
@@ -72,6 +122,10 @@ struct Segment
     flags.rst = other.flags.rst;
     flags.syn = other.flags.syn;
     flags.fin = other.flags.fin;
+    window = other.window;
+    checksum = other.checksum;
+    urgPointer = other.urgPointer;
+    payloadSize = other.payloadSize;
   }
 } __attribute__((packed));
 
@@ -81,10 +135,91 @@ const uint8_t ACK_FLAG = 16;
 const uint8_t SYN_ACK_FLAG = SYN_FLAG | ACK_FLAG;
 const uint8_t FIN_ACK_FLAG = FIN_FLAG | ACK_FLAG;
 
+/**
+ * Serial number arithmetic (RFC 1982): a comes before b when b is less than
+ * 2^31 ahead of it, so comparisons keep working after seqNum wraps around.
+ */
+inline bool seqLt(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+inline bool seqLeq(uint32_t a, uint32_t b) { return (int32_t)(a - b) <= 0; }
+inline bool seqGt(uint32_t a, uint32_t b) { return (int32_t)(a - b) > 0; }
+inline bool seqGeq(uint32_t a, uint32_t b) { return (int32_t)(a - b) >= 0; }
+inline uint32_t seqMax(uint32_t a, uint32_t b) { return seqLt(a, b) ? b : a; }
+inline uint32_t seqMin(uint32_t a, uint32_t b) { return seqLt(a, b) ? a : b; }
+
 // Payload size di options 32 bit
 const uint32_t HEADER_SIZE = 24;
+const uint32_t MAX_HEADER_SIZE = HEADER_SIZE + MAX_OPTIONS_SIZE;
+// IPv4 and UDP headers in front of every segment on the wire
+const uint32_t IP_UDP_OVERHEAD = 28;
+// Payload of a segment that fills an MTU of mtu bytes
+constexpr uint32_t payloadForMtu(uint32_t mtu) {
+  return mtu - IP_UDP_OVERHEAD - HEADER_SIZE;
+}
+// Default payload limit, a 1500 byte datagram, and what a peer that announces
+// no MSS is assumed to accept. Path MTU probing replaces it with the payload
+// of a real MTU, see payloadForMtu().
 const uint32_t MAX_PAYLOAD_SIZE = 1476;
+// Largest payload a connection may negotiate, a 9000 byte jumbo frame
+const uint32_t MAX_JUMBO_PAYLOAD_SIZE = payloadForMtu(9000);
+// Where path MTU discovery starts and the least it assumes of any path,
+// the 1200 byte base PLPMTU of RFC 8899
+const uint32_t BASE_PAYLOAD_SIZE = payloadForMtu(1200);
 const uint32_t MAX_SEGMENT_SIZE = HEADER_SIZE + MAX_PAYLOAD_SIZE; // MTU: 1500
+// Largest datagram we accept by default, a full payload behind a header
+// with options. Sockets configured for a larger MTU accept more.
+const uint32_t MAX_DATAGRAM_SIZE = MAX_HEADER_SIZE + MAX_PAYLOAD_SIZE;
+static_assert(MAX_SEGMENT_SIZE <= PAYLOAD_BLOCK_SIZE,
+              "segment payloads must fit a slab block");
+static_assert(MAX_JUMBO_PAYLOAD_SIZE <= PAYLOAD_JUMBO_BLOCK_SIZE,
+              "jumbo payloads must fit a jumbo slab block");
+
+// Option kinds, numbered like their TCP counterparts
+const uint8_t OPTION_END = 0;
+const uint8_t OPTION_NOP = 1;
+const uint8_t OPTION_MSS = 2;
+const uint8_t OPTION_WINDOW_SCALE = 3;
+const uint8_t OPTION_SACK = 5;
+// Experimental kind (RFC 4727), marks a connection as one of several streams
+const uint8_t OPTION_STREAM = 253;
+// Experimental kind, marks a path MTU probe and the ACK that answers it
+const uint8_t OPTION_PATH_PROBE = 254;
+
+// Largest shift a window scale option may carry (RFC 7323)
+const uint8_t MAX_WINDOW_SCALE = 14;
+
+/**
+ * Which part of the content a connection carries when one transfer is split
+ * over several connections. The receiver asks for index of count on its SYN,
+ * the sender answers with where that part starts and how long it is.
+ */
+struct StreamRange
+{
+  uint8_t index;
+  uint8_t count;
+  uint64_t offset;
+  uint64_t length;
+};
+
+/**
+ * Range of segments [start, end) the receiver holds beyond the cumulative ACK
+ */
+struct SackBlock
+{
+  uint32_t start;
+  uint32_t end;
+};
+
+const uint32_t MAX_SACK_BLOCKS = 4;
+
+/**
+ * Segment decoded in place. segment.payload points into buffer, so copies of
+ * the view share the received bytes instead of duplicating them.
+ */
+struct SegmentView
+{
+  Segment segment;
+  RecvBufferRef buffer;
+};
 
 /**
  * Generate Segment that contain broadcast packet
@@ -122,7 +257,7 @@ Segment fin(uint32_t seqNum, uint32_t ackNum);
 Segment finAck(uint32_t seqNum, uint32_t ackNum);
 
 // update return type as needed
-uint16_t calculateChecksum(Segment &segment);
+uint16_t calculateChecksum(const Segment &segment);
 
 /**
  * Return a new segment with a calcuated checksum fields
@@ -133,7 +268,7 @@ void updateChecksum(Segment &segment);
 /**
  * Check if a TCP Segment has a valid checksum
  */
-bool isValidChecksum(Segment segment);
+bool isValidChecksum(const Segment &segment);
 
 /**
  * Custom constructor Segment
@@ -145,6 +280,12 @@ Segment createSegment(const string &data, uint16_t sport, uint16_t dport);
  */
 Segment copySegment(const Segment &source);
 
+/**
+ * Copy of the header that points at source's payload without owning it,
+ * valid only while source's payload is alive
+ */
+Segment borrowSegment(const Segment &source);
+
 /**
  * Print segment info for debug
  */
@@ -156,14 +297,120 @@ void printSegment(const Segment &segment);
 bool operator==(const Segment &lhs, const Segment &rhs);
 
 /**
- * Encoding Segment to Buffer for Transmitting
+ * Header length on the wire including options
+ */
+uint32_t headerLength(const Segment &segment);
+
+/**
+ * Append an option (kind, length, data) and grow data_offset to cover it.
+ * Returns false when the option area is full or already malformed.
+ */
+bool addOption(Segment &segment, uint8_t kind, const uint8_t *data,
+               uint8_t length);
+
+/**
+ * Find an option by kind, returns its data or nullptr
+ */
+const uint8_t *findOption(const Segment &segment, uint8_t kind,
+                          uint8_t &length);
+
+/**
+ * Attach up to MAX_SACK_BLOCKS blocks, the first one should be the most
+ * recent. Only as many as fit beside the options already set are kept.
+ */
+void setSackBlocks(Segment &segment, const vector<SackBlock> &blocks);
+
+/**
+ * Read the SACK blocks carried by a segment
+ */
+vector<SackBlock> getSackBlocks(const Segment &segment);
+
+/**
+ * Offer a window scale shift, only meaningful on SYN and SYN-ACK
+ */
+void setWindowScale(Segment &segment, uint8_t shift);
+
+/**
+ * Read the offered window scale shift, false when the option is absent
+ */
+bool getWindowScale(const Segment &segment, uint8_t &shift);
+
+/**
+ * Announce the largest payload we accept, only meaningful on SYN and SYN-ACK
+ */
+void setMaxSegmentSize(Segment &segment, uint32_t payloadSize);
+
+/**
+ * Read the peer's largest accepted payload, false when the option is absent
+ */
+bool getMaxSegmentSize(const Segment &segment, uint32_t &payloadSize);
+
+/**
+ * Path MTU probe: a segment of exactly datagramPayload bytes after the
+ * fixed header, made of padding and tagged with probeId. It carries no data
+ * and takes no sequence number, the receiver only echoes the tag in an ACK.
+ */
+Segment pathProbe(uint32_t probeId, uint32_t seqNum, uint32_t datagramPayload);
+
+/**
+ * Tag an ACK as the answer to a path MTU probe
+ */
+void setPathProbe(Segment &segment, uint32_t probeId);
+
+/**
+ * Read the probe tag, false for ordinary segments
+ */
+bool getPathProbe(const Segment &segment, uint32_t &probeId);
+
+/**
+ * Attach a stream option, only meaningful on SYN and SYN-ACK
+ */
+void setStreamRange(Segment &segment, const StreamRange &range);
+
+/**
+ * Read the stream option, false when the option is absent or malformed
+ */
+bool getStreamRange(const Segment &segment, StreamRange &range);
+
+/**
+ * Encode only the header and options, payload is sent from its own buffer
+ */
+void encodeHeader(const Segment &segment, uint8_t *buffer);
+
+/**
+ * Encoding Segment to Buffer for Transmitting. The checksum is computed
+ * while the payload is copied and written into the buffer, whatever
+ * segment.checksum holds.
  */
 void encodeSegment(const Segment &segment, uint8_t *buffer);
 
 /**
- * Decode Buffer received to Segment
+ * Decode Buffer received to Segment, verifying the checksum while the payload
+ * is copied. Returns false, with no payload allocated, when the buffer is
+ * truncated or corrupt.
+ */
+bool decodeSegment(const uint8_t *buffer, uint32_t length, Segment &segment);
+
+/**
+ * Check bounds and checksum straight on a received buffer, so corrupt
+ * datagrams are dropped before anything is decoded or allocated
+ */
+bool isValidSegment(const uint8_t *buffer, uint32_t length);
+
+/**
+ * Decode a received buffer without copying the payload, verifying the
+ * checksum on the way. Returns false when length cannot hold the header plus
+ * the advertised payload or the checksum does not match.
+ */
+bool decodeSegmentView(const RecvBufferRef &buffer, uint32_t length,
+                       SegmentView &view);
+
+/**
+ * Decode the datagram of length bytes at offset, for receive buffers that
+ * hold several datagrams back to back (UDP GRO). The view shares buffer.
  */
-Segment decodeSegment(const uint8_t *buffer, uint32_t length);
+bool decodeSegmentView(const RecvBufferRef &buffer, uint32_t offset,
+                       uint32_t length, SegmentView &view);
 
 /**
  * Change flags to uint8_t
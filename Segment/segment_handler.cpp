@@ -2,82 +2,269 @@
 #include "segment.hpp"
 
 SegmentHandler::SegmentHandler()
-    : windowSize(5), currentSeqNum(0), currentAckNum(0), dataStream(nullptr),
-      dataSize(0), dataIndex(0) {}
+    : congestion(makeCongestionControl(CongestionAlgorithm::NEW_RENO)),
+      currentSeqNum(0), currentAckNum(0), firstSeqNum(0),
+      highestSeqNum(0), sourcePort(0), destPort(0), source(nullptr),
+      dataSegments(0), totalSegments(0), eofMarked(false), readFailed(false),
+      dataIndex(0), segmentSize(MAX_PAYLOAD_SIZE), builtBytes(0),
+      releasedBytes(0), bufferBase(0) {}
 
-SegmentHandler::~SegmentHandler() {
-  for (Segment &seg : segmentBuffer) {
-    delete[] seg.payload;
+SegmentHandler::~SegmentHandler() {}
+
+void SegmentHandler::setDataStream(uint8_t *dataStream, uint64_t dataSize,
+                                   uint32_t startingSeqNum, uint16_t sourcePort,
+                                   uint16_t destPort) {
+  ownedSource.reset(new MemorySource(dataStream, dataSize));
+  setDataSource(*ownedSource, startingSeqNum, sourcePort, destPort);
+}
+
+void SegmentHandler::setDataSource(DataSource &source, uint32_t startingSeqNum,
+                                   uint16_t sourcePort, uint16_t destPort) {
+  lock_guard<mutex> lock(mtx);
+  segmentBuffer.clear();
+  bufferBase = 0;
+
+  this->source = &source;
+  this->sourcePort = sourcePort;
+  this->destPort = destPort;
+  builtBytes = 0;
+  releasedBytes = 0;
+  uint64_t segments = (source.size() + segmentSize - 1) / segmentSize;
+  // Serial arithmetic only orders seqNums less than half the space apart
+  readFailed = segments >= MAX_TRANSFER_SEGMENTS;
+  dataSegments = readFailed ? 0 : static_cast<uint32_t>(segments);
+  totalSegments = dataSegments;
+  metadataName.clear();
+  eofMarked = false;
+
+  currentSeqNum = startingSeqNum - 1;
+  currentAckNum = startingSeqNum - 1;
+  firstSeqNum = startingSeqNum;
+  highestSeqNum = startingSeqNum - 1;
+  selectiveAcked.assign(dataSegments, false);
+  // advanceWindow pre-increments, so start one before the first segment
+  dataIndex = -1;
+  source.willNeed(0, (uint64_t)READ_CHUNK_MAX_SEGMENTS * segmentSize);
+}
+
+void SegmentHandler::setSegmentSize(uint32_t size) {
+  lock_guard<mutex> lock(mtx);
+  segmentSize = max<uint32_t>(size, 1);
+  if (source != nullptr) {
+    recountSegments();
   }
 }
 
-void SegmentHandler::generateSegments(uint32_t startingSeqNum,
-                                      uint16_t sourcePort, uint16_t destPort) {
-  for (Segment &seg : segmentBuffer) {
-    delete[] seg.payload;
+uint32_t SegmentHandler::getSegmentSize() {
+  lock_guard<mutex> lock(mtx);
+  return segmentSize;
+}
+
+void SegmentHandler::recountSegments() {
+  uint32_t built = bufferBase + segmentBuffer.size();
+  if (built >= dataSegments || readFailed) {
+    return;
   }
-  segmentBuffer.clear();
-  uint32_t numSegments = (dataSize + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+  uint64_t remaining = source->size() - builtBytes;
+  uint64_t segments = built + (remaining + segmentSize - 1) / segmentSize;
+  bool hasMetadata = totalSegments > dataSegments;
+  if (segments + (hasMetadata ? 1 : 0) >= MAX_TRANSFER_SEGMENTS) {
+    readFailed = true;
+    return;
+  }
+  dataSegments = static_cast<uint32_t>(segments);
+  totalSegments = dataSegments + (hasMetadata ? 1 : 0);
+  // Nothing past built can have been acknowledged yet
+  selectiveAcked.resize(built);
+  selectiveAcked.resize(totalSegments, false);
+}
 
-  segmentBuffer.resize(numSegments);
-  uint32_t iterator = 0;
-  for (uint32_t i = 0; i < numSegments; i++) {
-    uint32_t payloadSize =
-        min(MAX_PAYLOAD_SIZE, dataSize - i * MAX_PAYLOAD_SIZE);
+void SegmentHandler::buildChunk() {
+  uint32_t index = bufferBase + segmentBuffer.size();
+  uint32_t chunk = min(max(getWindowSize(), READ_CHUNK_MIN_SEGMENTS),
+                       READ_CHUNK_MAX_SEGMENTS);
+  uint32_t count = min(chunk, dataSegments - index);
+  uint64_t offset = builtBytes;
 
+  // One preadv straight into the payloads of the whole chunk
+  vector<iovec> parts;
+  parts.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t payloadSize = static_cast<uint32_t>(
+        min<uint64_t>(segmentSize, source->size() - builtBytes));
+    builtBytes += payloadSize;
     segmentBuffer.emplace_back();
     Segment &seg = segmentBuffer.back();
-
-    seg.payload = new uint8_t[payloadSize];
-    memcpy(seg.payload, static_cast<uint8_t *>(dataStream) + iterator,
-           payloadSize);
-    seg.window = windowSize;
+    seg.payload = allocatePayload(payloadSize);
     seg.payloadSize = payloadSize;
-    seg.seqNum = startingSeqNum + i;
+    seg.seqNum = firstSeqNum + index + i;
     seg.sourcePort = sourcePort;
     seg.destPort = destPort;
+    seg.window = static_cast<uint16_t>(min(getWindowSize(), 0xFFFFu));
+    parts.push_back({seg.payload, payloadSize});
+  }
+  if (!source->read(offset, parts.data(), static_cast<int>(parts.size()))) {
+    readFailed = true;
+  }
 
-    iterator += payloadSize;
-    // while (seg.checksum == 0)
-    // {
-    seg.checksum = calculateChecksum(seg);
+  for (uint32_t i = 0; i < count; i++) {
+    Segment &seg = segmentBuffer[index + i - bufferBase];
+    if (eofMarked && index + i == totalSegments - 1) {
+      seg.flags.psh = 1;
+    }
     updateChecksum(seg);
-    // }
   }
 
-  dataIndex = numSegments - 1;
+  // Let the kernel fetch the next chunk while this one is in flight
+  uint64_t chunkBytes = (uint64_t)chunk * segmentSize;
+  source->willNeed(builtBytes, chunkBytes);
 }
 
-void SegmentHandler::setDataStream(uint8_t *dataStream, uint32_t dataSize,
-                                   uint32_t startingSeqNum, uint16_t sourcePort,
-                                   uint16_t destPort) {
-  this->dataStream = dataStream;
-  this->dataSize = dataSize;
-  currentSeqNum = startingSeqNum - 1;
-  currentAckNum = startingSeqNum - 1;
+void SegmentHandler::buildMetadata() {
+  segmentBuffer.emplace_back();
+  Segment &seg = segmentBuffer.back();
+  seg.payloadSize = static_cast<uint32_t>(metadataName.length());
+  seg.payload = allocatePayload(seg.payloadSize);
+  memcpy(seg.payload, metadataName.data(), seg.payloadSize);
+  seg.sourcePort = sourcePort;
+  seg.destPort = destPort;
+  seg.window = static_cast<uint16_t>(min(getWindowSize(), 0xFFFFu));
+  seg.seqNum = firstSeqNum + dataSegments;
+  seg.flags.ece = 1;
+  seg.flags.psh = eofMarked ? 1 : 0;
+  updateChecksum(seg);
+}
+
+Segment *SegmentHandler::segmentAtIndex(uint32_t index) {
+  if (index >= totalSegments || index < bufferBase) {
+    return nullptr;
+  }
+  while (bufferBase + segmentBuffer.size() <= index) {
+    if (bufferBase + segmentBuffer.size() < dataSegments) {
+      buildChunk();
+    } else {
+      buildMetadata();
+    }
+  }
+  return &segmentBuffer[index - bufferBase];
+}
+
+void SegmentHandler::releaseSegments() {
+  uint32_t acked = currentAckNum + 1 - firstSeqNum;
+  uint64_t firstReleased = releasedBytes;
+  while (!segmentBuffer.empty() && bufferBase < acked) {
+    if (bufferBase < dataSegments) {
+      releasedBytes += segmentBuffer.front().payloadSize;
+    }
+    segmentBuffer.pop_front();
+    bufferBase++;
+  }
+  if (segmentBuffer.empty() && bufferBase < acked) {
+    bufferBase = acked;
+  }
+  if (releasedBytes > firstReleased) {
+    source->doneWith(firstReleased, releasedBytes - firstReleased);
+  }
+}
+
+void SegmentHandler::setCongestionControl(CongestionAlgorithm algo) {
+  congestion = makeCongestionControl(algo);
+}
 
-  generateSegments(startingSeqNum, sourcePort, destPort);
+CongestionControl &SegmentHandler::getCongestionControl() {
+  return *congestion;
 }
 
-uint8_t SegmentHandler::getWindowSize() { return this->windowSize; }
+uint32_t SegmentHandler::getWindowSize() { return congestion->getWindow(); }
 
-Segment *SegmentHandler::advanceWindow(uint8_t size) {
+Segment *SegmentHandler::advanceWindow(uint32_t size) {
   lock_guard<mutex> lock(mtx);
-  if (dataIndex + 1 >= segmentBuffer.size()) {
+  if (dataIndex + 1 >= totalSegments) {
     return nullptr;
   } else {
     currentSeqNum += size;
     dataIndex += 1;
+    highestSeqNum = seqMax(highestSeqNum, currentSeqNum);
   }
 
-  return &segmentBuffer[dataIndex];
+  return segmentAtIndex(dataIndex);
 }
 
 void SegmentHandler::ackWindow(uint32_t seqNum) {
   lock_guard<mutex> lock(mtx);
-  if (seqNum > currentAckNum) {
+  if (seqGt(seqNum, currentAckNum)) {
     currentAckNum = seqNum;
   }
+  slideAcked();
+}
+
+uint32_t SegmentHandler::acknowledge(uint32_t ackNum) {
+  lock_guard<mutex> lock(mtx);
+  // ackNum is the next segment the receiver expects, so it covers
+  // everything below it no matter which earlier ACKs were lost
+  uint32_t seqNum = ackNum - 1;
+  if (seqLeq(seqNum, currentAckNum) || seqGt(seqNum, highestSeqNum)) {
+    return 0;
+  }
+  uint32_t previous = currentAckNum;
+  currentAckNum = seqNum;
+  slideAcked();
+  return currentAckNum - previous;
+}
+
+void SegmentHandler::slideAcked() {
+  while (currentAckNum + 1 - firstSeqNum < selectiveAcked.size() &&
+         selectiveAcked[currentAckNum + 1 - firstSeqNum]) {
+    currentAckNum++;
+  }
+  // After goBackWindow the receiver may acknowledge past the resend point
+  if (seqGt(currentAckNum, currentSeqNum)) {
+    dataIndex += currentAckNum - currentSeqNum;
+    currentSeqNum = currentAckNum;
+  }
+  releaseSegments();
+}
+
+bool SegmentHandler::markAcked(uint32_t seqNum) {
+  lock_guard<mutex> lock(mtx);
+  uint32_t index = seqNum - firstSeqNum;
+  if (seqLeq(seqNum, currentAckNum) || seqGt(seqNum, highestSeqNum) ||
+      index >= selectiveAcked.size() || selectiveAcked[index]) {
+    return false;
+  }
+  selectiveAcked[index] = true;
+  slideAcked();
+  return true;
+}
+
+uint32_t SegmentHandler::applySack(const vector<SackBlock> &blocks) {
+  lock_guard<mutex> lock(mtx);
+  uint32_t updated = 0;
+  for (const SackBlock &block : blocks) {
+    // Only outstanding segments can be on the scoreboard
+    uint32_t start = seqMax(block.start, currentAckNum + 1);
+    uint32_t end = seqMin(block.end, highestSeqNum + 1);
+    for (uint32_t seqNum = start; seqLt(seqNum, end); seqNum++) {
+      uint32_t index = seqNum - firstSeqNum;
+      if (index < selectiveAcked.size() && !selectiveAcked[index]) {
+        selectiveAcked[index] = true;
+        updated++;
+      }
+    }
+  }
+  return updated;
+}
+
+bool SegmentHandler::isAcked(uint32_t seqNum) {
+  lock_guard<mutex> lock(mtx);
+  uint32_t index = seqNum - firstSeqNum;
+  return seqLeq(seqNum, currentAckNum) ||
+         (index < selectiveAcked.size() && selectiveAcked[index]);
+}
+
+Segment *SegmentHandler::segmentAt(uint32_t seqNum) {
+  lock_guard<mutex> lock(mtx);
+  return segmentAtIndex(seqNum - firstSeqNum);
 }
 
 uint32_t SegmentHandler::getCurrentSeqNum() {
@@ -98,18 +285,34 @@ void SegmentHandler::goBackWindow() {
 
 bool SegmentHandler::isFinished(uint32_t startingSeqNum) {
   lock_guard<mutex> lock(mtx);
-  return currentAckNum - startingSeqNum + 1 == (segmentBuffer.size() + 1) / 2;
+  return currentAckNum - startingSeqNum + 1 == totalSegments;
+}
+
+bool SegmentHandler::hasReadError() {
+  lock_guard<mutex> lock(mtx);
+  return readFailed;
 }
 
 void SegmentHandler::addMetadata(string fileFullName, uint16_t sourcePort,
                                  uint16_t destPort) {
-  Segment seg = createSegment(fileFullName, sourcePort, destPort);
-  seg.payloadSize = static_cast<uint16_t>(fileFullName.length());
-  seg.window = windowSize;
-  seg.seqNum = segmentBuffer.back().seqNum + 1;
-  seg.flags.ece = 1;
-  updateChecksum(seg);
-  segmentBuffer.push_back(seg);
+  lock_guard<mutex> lock(mtx);
+  // Built lazily after the data segments like any other segment
+  this->sourcePort = sourcePort;
+  this->destPort = destPort;
+  metadataName = fileFullName;
+  totalSegments = dataSegments + 1;
+  selectiveAcked.push_back(false);
 }
 
-void SegmentHandler::markEOF() { segmentBuffer.back().flags.psh = 1; }
\ No newline at end of file
+void SegmentHandler::markEOF() {
+  lock_guard<mutex> lock(mtx);
+  if (totalSegments == 0) {
+    return;
+  }
+  eofMarked = true;
+  // Only matters if the last segment was built already
+  uint32_t last = totalSegments - 1;
+  if (last >= bufferBase && last < bufferBase + segmentBuffer.size()) {
+    segmentBuffer[last - bufferBase].flags.psh = 1;
+  }
+}
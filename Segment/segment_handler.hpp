@@ -1,42 +1,91 @@
 #ifndef segment_handler_h
 #define segment_handler_h
 
+#include "congestion_control.hpp"
+#include "data_source.hpp"
 #include "segment.hpp"
 #include <cmath>
 #include <cstring>
+#include <deque>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 using namespace std;
 
+// Segments read from the source per preadv, scaled with the window
+const uint32_t READ_CHUNK_MIN_SEGMENTS = 64;
+const uint32_t READ_CHUNK_MAX_SEGMENTS = 1024;
+// Largest transfer in segments, metadata included, that seqNums can tell apart
+const uint64_t MAX_TRANSFER_SEGMENTS = 1u << 31;
+
 class SegmentHandler {
 private:
-  uint32_t windowSize;
+  unique_ptr<CongestionControl> congestion;
   uint32_t currentSeqNum;
   uint32_t currentAckNum;
-  void *dataStream;
-  uint32_t dataSize;
+  uint32_t firstSeqNum;
+  uint32_t highestSeqNum; // highest segment ever sent, survives goBackWindow
+  uint16_t sourcePort;
+  uint16_t destPort;
+  DataSource *source;
+  unique_ptr<MemorySource> ownedSource; // backs setDataStream
+  uint32_t dataSegments;                // segments cut from source
+  uint32_t totalSegments;               // plus the metadata segment
+  string metadataName;
+  bool eofMarked;
+  bool readFailed;
   uint32_t dataIndex;
+  // Payload bytes per data segment built from now on
+  uint32_t segmentSize;
+  // Source bytes cut into segments so far, and released again once acked
+  uint64_t builtBytes;
+  uint64_t releasedBytes;
   mutex mtx;
-  vector<Segment> segmentBuffer; // or use std vector if you like
+  // Segments built so far and not yet acknowledged, the first one has index
+  // bufferBase. Built in chunks on demand and released once acked, so only
+  // about a window of payloads is ever in memory.
+  deque<Segment> segmentBuffer;
+  uint32_t bufferBase;
+  vector<bool> selectiveAcked; // per segment, for Selective Repeat
 
-  // Ubah dataStream jadi segment2
-  void generateSegments(uint32_t startingSeqNum,uint16_t sourcePort,uint16_t destPort);
+  // Segment at index, built (with the rest of its chunk) when needed
+  Segment *segmentAtIndex(uint32_t index);
+  void buildChunk();
+  void buildMetadata();
+  void releaseSegments();
+  // Move currentAckNum past segments already acknowledged out of order
+  void slideAcked();
+  // Recount the data segments once the segment size changed
+  void recountSegments();
 
 public:
   SegmentHandler();
   ~SegmentHandler();
-  void setDataStream(uint8_t *dataStream, uint32_t dataSize, uint32_t startingSeqNum, uint16_t sourcePort,uint16_t destPort);
-  uint8_t getWindowSize();
-  Segment *advanceWindow(uint8_t size);
+  void setDataStream(uint8_t *dataStream, uint64_t dataSize, uint32_t startingSeqNum, uint16_t sourcePort,uint16_t destPort);
+  void setDataSource(DataSource &source, uint32_t startingSeqNum, uint16_t sourcePort, uint16_t destPort);
+  void setCongestionControl(CongestionAlgorithm algo);
+  CongestionControl &getCongestionControl();
+  // Payload size of segments not built yet. Segments already built keep
+  // their size, so a transfer may mix sizes.
+  void setSegmentSize(uint32_t size);
+  uint32_t getSegmentSize();
+  uint32_t getWindowSize();
+  Segment *advanceWindow(uint32_t size);
   void ackWindow(uint32_t seqNum);
+  uint32_t acknowledge(uint32_t ackNum);
+  bool markAcked(uint32_t seqNum);
+  uint32_t applySack(const vector<SackBlock> &blocks);
+  bool isAcked(uint32_t seqNum);
+  Segment *segmentAt(uint32_t seqNum);
   uint32_t getCurrentSeqNum();
   uint32_t getCurrentAckNum();
   void goBackWindow();
   bool isFinished(uint32_t startingSeqNum);
+  bool hasReadError();
   void addMetadata(string fileFullName, uint16_t sourcePort, uint16_t destPort);
   void markEOF();
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,511 @@
+#include "packet_demux.hpp"
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+constexpr uint8_t SHAPE_IP = 1;
+constexpr uint8_t SHAPE_PORT = 2;
+constexpr uint8_t SHAPE_SEQ = 4;
+constexpr uint8_t SHAPE_ACK = 8;
+constexpr uint8_t SHAPE_FLAGS = 16;
+constexpr uint8_t SHAPE_PEER = SHAPE_IP | SHAPE_PORT;
+
+// Shapes from most to least specific, so exact waiters win over wildcards
+const std::array<uint8_t, 32> &shapeOrder()
+{
+  static const std::array<uint8_t, 32> order = []()
+  {
+    std::array<uint8_t, 32> shapes;
+    for (uint8_t i = 0; i < 32; i++)
+    {
+      shapes[i] = i;
+    }
+    std::stable_sort(shapes.begin(), shapes.end(), [](uint8_t a, uint8_t b)
+                     { return __builtin_popcount(a) > __builtin_popcount(b); });
+    return shapes;
+  }();
+  return order;
+}
+
+static_assert(DEMUX_EXACT_SEQ == SHAPE_SEQ && DEMUX_EXACT_ACK == SHAPE_ACK,
+              "exact bits are shape bits");
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex words must be plain 32-bit integers");
+
+// Sleep while word still holds expected, false once deadline has passed
+bool futexWait(std::atomic<uint32_t> &word, uint32_t expected,
+               std::chrono::steady_clock::time_point deadline)
+{
+  auto left = deadline - std::chrono::steady_clock::now();
+  if (left <= std::chrono::steady_clock::duration::zero())
+  {
+    return false;
+  }
+  auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(left);
+  timespec timeout;
+  timeout.tv_sec = nanos.count() / 1000000000;
+  timeout.tv_nsec = nanos.count() % 1000000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE,
+          expected, &timeout, nullptr, 0);
+  return true;
+}
+
+void futexWakeAll(std::atomic<uint32_t> &word)
+{
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE,
+          INT_MAX, nullptr, nullptr, 0);
+}
+
+// How long the listener sleeps at a time while the ring is full
+constexpr auto PRODUCER_WAIT = std::chrono::milliseconds(10);
+} // namespace
+
+uint8_t DemuxFilter::shape() const
+{
+  uint8_t result = 0;
+  if (!ip.empty())
+    result |= SHAPE_IP;
+  if (port != 0)
+    result |= SHAPE_PORT;
+  if (seqNum != 0 || (exact & SHAPE_SEQ))
+    result |= SHAPE_SEQ;
+  if (ackNum != 0 || (exact & SHAPE_ACK))
+    result |= SHAPE_ACK;
+  if (flags != 0)
+    result |= SHAPE_FLAGS;
+  return result;
+}
+
+bool DemuxFilter::matches(const Message &message) const
+{
+  uint8_t fields = shape();
+  return (!(fields & SHAPE_IP) || message.ip == ip) &&
+         (!(fields & SHAPE_PORT) || message.port == port) &&
+         (!(fields & SHAPE_SEQ) || message.segment.seqNum == seqNum) &&
+         (!(fields & SHAPE_ACK) || message.segment.ackNum == ackNum) &&
+         (!(fields & SHAPE_FLAGS) || getFlags8(&message.segment) == flags);
+}
+
+DemuxFilter exactAck(const string &ip, uint16_t port, uint32_t ackNum,
+                     uint8_t flags)
+{
+  DemuxFilter filter{ip, port, 0, ackNum, flags};
+  filter.exact = DEMUX_EXACT_ACK;
+  return filter;
+}
+
+bool DemuxKey::operator==(const DemuxKey &other) const
+{
+  return shape == other.shape && port == other.port &&
+         seqNum == other.seqNum && ackNum == other.ackNum &&
+         flags == other.flags && ip == other.ip;
+}
+
+size_t DemuxKeyHash::operator()(const DemuxKey &key) const
+{
+  size_t hash = std::hash<string>()(key.ip);
+  auto mix = [&hash](uint64_t value)
+  { hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2); };
+  mix(key.port);
+  mix(key.seqNum);
+  mix(key.ackNum);
+  mix(((uint64_t)key.flags << 8) | key.shape);
+  return hash;
+}
+
+PacketDemux::PacketDemux()
+    : ring(DEMUX_RING_CAPACITY), arrivalSignal(0), drainSignal(0),
+      sleepers(0), producerWaiting(false), closed(false), arrivals(0),
+      shapeWaiters{}, pendingCount(0) {}
+
+DemuxKey PacketDemux::project(const Message &message, uint8_t shape)
+{
+  DemuxKey key;
+  key.ip = (shape & SHAPE_IP) ? message.ip : string();
+  key.port = (shape & SHAPE_PORT) ? message.port : 0;
+  key.seqNum = (shape & SHAPE_SEQ) ? message.segment.seqNum : 0;
+  key.ackNum = (shape & SHAPE_ACK) ? message.segment.ackNum : 0;
+  key.flags = (shape & SHAPE_FLAGS) ? getFlags8(&message.segment) : 0;
+  key.shape = shape;
+  return key;
+}
+
+DemuxKey PacketDemux::project(const DemuxFilter &filter)
+{
+  return DemuxKey{filter.ip, filter.port, filter.seqNum,
+                  filter.ackNum, filter.flags, filter.shape()};
+}
+
+DemuxKey PacketDemux::peerKey(const string &ip, uint16_t port)
+{
+  return DemuxKey{ip, port, 0, 0, 0, SHAPE_PEER};
+}
+
+bool PacketDemux::enqueue(Message &&message)
+{
+  while (!ring.push(std::move(message)))
+  {
+    if (closed.load())
+    {
+      return false;
+    }
+    // Publish that we wait before looking at the ring again, a consumer
+    // draining in between either sees the flag or leaves room we see
+    uint32_t seen = drainSignal.load();
+    producerWaiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.full())
+    {
+      futexWait(drainSignal, seen,
+                std::chrono::steady_clock::now() + PRODUCER_WAIT);
+    }
+    producerWaiting.store(false);
+  }
+  return true;
+}
+
+void PacketDemux::signalArrival()
+{
+  arrivalSignal.fetch_add(1);
+  if (sleepers.load() > 0)
+  {
+    futexWakeAll(arrivalSignal);
+  }
+}
+
+void PacketDemux::deliver(Message &&message)
+{
+  if (enqueue(std::move(message)))
+  {
+    signalArrival();
+  }
+}
+
+void PacketDemux::deliver(std::vector<Message> &messages)
+{
+  bool delivered = false;
+  for (Message &message : messages)
+  {
+    delivered = enqueue(std::move(message)) || delivered;
+  }
+  // One wakeup for the whole batch
+  if (delivered)
+  {
+    signalArrival();
+  }
+}
+
+void PacketDemux::drain()
+{
+  Message message;
+  bool drained = false;
+  while (ring.pop(message))
+  {
+    // A peer at its backlog limit loses the packet in storePending, it
+    // never holds up the packets behind it for other peers
+    if (!handToWaiter(message))
+    {
+      storePending(std::move(message));
+    }
+    drained = true;
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (drained && producerWaiting.load())
+  {
+    drainSignal.fetch_add(1);
+    futexWakeAll(drainSignal);
+  }
+}
+
+bool PacketDemux::isClaimed(const DemuxKey &peer) const
+{
+  return !claimedPeers.empty() && claimedPeers.count(peer) > 0;
+}
+
+bool PacketDemux::handToWaiter(Message &message)
+{
+  bool claimed = isClaimed(peerKey(message.ip, message.port));
+  for (uint8_t shape : shapeOrder())
+  {
+    if (shapeWaiters[shape] == 0 ||
+        (claimed && (shape & SHAPE_PEER) != SHAPE_PEER))
+    {
+      continue;
+    }
+    auto it = waiters.find(project(message, shape));
+    if (it == waiters.end())
+    {
+      continue;
+    }
+    Waiter *waiter = it->second.front();
+    it->second.pop_front();
+    if (it->second.empty())
+    {
+      waiters.erase(it);
+    }
+    shapeWaiters[shape]--;
+
+    // The waiter is asleep on arrivalSignal, which moved when this message
+    // was delivered, so it wakes up and finds itself filled
+    waiter->message = std::move(message);
+    waiter->filled = true;
+    return true;
+  }
+  return false;
+}
+
+void PacketDemux::storePending(Message &&message)
+{
+  DemuxKey peer = peerKey(message.ip, message.port);
+  PendingList &list = pendingByPeer[peer];
+  // Drop the newest, the oldest is the one the peer's reader needs next
+  if (list.size() >= DEMUX_PENDING_LIMIT)
+  {
+    return;
+  }
+
+  DemuxKey byAck = project(message, SHAPE_PEER | SHAPE_ACK | SHAPE_FLAGS);
+  DemuxKey bySeq = project(message, SHAPE_PEER | SHAPE_SEQ | SHAPE_FLAGS);
+  list.push_back(Pending{arrivals++, std::move(message)});
+  auto it = std::prev(list.end());
+  pendingByAck[byAck].push_back(it);
+  pendingBySeq[bySeq].push_back(it);
+  pendingCount++;
+}
+
+Message PacketDemux::removePending(PendingList &list, PendingList::iterator it)
+{
+  auto unindex = [&it](PendingIndex &index, const DemuxKey &key)
+  {
+    auto found = index.find(key);
+    if (found == index.end())
+    {
+      return;
+    }
+    auto &entries = found->second;
+    entries.erase(std::find(entries.begin(), entries.end(), it));
+    if (entries.empty())
+    {
+      index.erase(found);
+    }
+  };
+  unindex(pendingByAck,
+          project(it->message, SHAPE_PEER | SHAPE_ACK | SHAPE_FLAGS));
+  unindex(pendingBySeq,
+          project(it->message, SHAPE_PEER | SHAPE_SEQ | SHAPE_FLAGS));
+
+  Message message = std::move(it->message);
+  list.erase(it);
+  pendingCount--;
+  return message;
+}
+
+bool PacketDemux::takePending(const DemuxFilter &filter, Message &out)
+{
+  if (pendingCount == 0)
+  {
+    return false;
+  }
+  uint8_t shape = filter.shape();
+
+  auto takeFrom = [&](PendingList &list, PendingList::iterator it)
+  {
+    out = removePending(list, it);
+    if (list.empty())
+    {
+      pendingByPeer.erase(peerKey(out.ip, out.port));
+    }
+    return true;
+  };
+
+  // Fully addressed filters are answered from an index in O(1)
+  if ((shape & SHAPE_PEER) == SHAPE_PEER && (shape & SHAPE_FLAGS) &&
+      (shape & (SHAPE_ACK | SHAPE_SEQ)))
+  {
+    bool byAck = shape & SHAPE_ACK;
+    PendingIndex &index = byAck ? pendingByAck : pendingBySeq;
+    DemuxKey key{filter.ip,
+                 filter.port,
+                 byAck ? 0 : filter.seqNum,
+                 byAck ? filter.ackNum : 0,
+                 filter.flags,
+                 (uint8_t)(SHAPE_PEER | SHAPE_FLAGS |
+                           (byAck ? SHAPE_ACK : SHAPE_SEQ))};
+    auto found = index.find(key);
+    if (found == index.end())
+    {
+      return false;
+    }
+    for (auto it : found->second)
+    {
+      if (filter.matches(it->message))
+      {
+        return takeFrom(pendingByPeer[peerKey(filter.ip, filter.port)], it);
+      }
+    }
+    return false;
+  }
+
+  if ((shape & SHAPE_PEER) == SHAPE_PEER)
+  {
+    auto peer = pendingByPeer.find(peerKey(filter.ip, filter.port));
+    if (peer == pendingByPeer.end())
+    {
+      return false;
+    }
+    for (auto it = peer->second.begin(); it != peer->second.end(); ++it)
+    {
+      if (filter.matches(it->message))
+      {
+        return takeFrom(peer->second, it);
+      }
+    }
+    return false;
+  }
+
+  // Wildcard peer (broadcast and handshake): oldest match across all peers
+  PendingList *bestList = nullptr;
+  PendingList::iterator best;
+  for (auto &peer : pendingByPeer)
+  {
+    if (isClaimed(peer.first))
+    {
+      continue;
+    }
+    for (auto it = peer.second.begin(); it != peer.second.end(); ++it)
+    {
+      if (bestList != nullptr && it->order >= best->order)
+      {
+        break;
+      }
+      if (filter.matches(it->message))
+      {
+        bestList = &peer.second;
+        best = it;
+        break;
+      }
+    }
+  }
+  return bestList != nullptr && takeFrom(*bestList, best);
+}
+
+void PacketDemux::unregister(Waiter &waiter)
+{
+  auto it = waiters.find(waiter.key);
+  if (it == waiters.end())
+  {
+    return;
+  }
+  auto &queue = it->second;
+  auto found = std::find(queue.begin(), queue.end(), &waiter);
+  if (found == queue.end())
+  {
+    return;
+  }
+  queue.erase(found);
+  shapeWaiters[waiter.key.shape]--;
+  if (queue.empty())
+  {
+    waiters.erase(it);
+  }
+}
+
+bool PacketDemux::take(const DemuxFilter &filter, Message &out,
+                       std::chrono::steady_clock::time_point deadline)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  if (closed.load())
+  {
+    return false;
+  }
+  drain();
+  if (takePending(filter, out))
+  {
+    return true;
+  }
+
+  Waiter waiter;
+  waiter.key = project(filter);
+  waiters[waiter.key].push_back(&waiter);
+  shapeWaiters[waiter.key.shape]++;
+
+  sleepers.fetch_add(1);
+  bool waited = true;
+  while (true)
+  {
+    // Read the signal before draining: anything delivered after this point
+    // changes it, so the futex wait below cannot miss it
+    uint32_t seen = arrivalSignal.load();
+    drain();
+    if (waiter.filled || closed.load() || !waited)
+    {
+      break;
+    }
+    lock.unlock();
+    waited = futexWait(arrivalSignal, seen, deadline);
+    lock.lock();
+  }
+  sleepers.fetch_sub(1);
+
+  if (waiter.filled)
+  {
+    out = std::move(waiter.message);
+    return true;
+  }
+  unregister(waiter);
+  return false;
+}
+
+void PacketDemux::claim(const string &ip, uint16_t port)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  claimedPeers.insert(peerKey(ip, port));
+}
+
+void PacketDemux::release(const string &ip, uint16_t port)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  DemuxKey peer = peerKey(ip, port);
+  claimedPeers.erase(peer);
+  auto found = pendingByPeer.find(peer);
+  if (found == pendingByPeer.end())
+  {
+    return;
+  }
+  PendingList &list = found->second;
+  while (!list.empty())
+  {
+    removePending(list, list.begin());
+  }
+  pendingByPeer.erase(found);
+}
+
+size_t PacketDemux::pending()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return pendingCount + ring.size();
+}
+
+bool PacketDemux::isClosed() { return closed.load(); }
+
+void PacketDemux::open()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  closed.store(false);
+}
+
+void PacketDemux::close()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  closed.store(true);
+  arrivalSignal.fetch_add(1);
+  futexWakeAll(arrivalSignal);
+  drainSignal.fetch_add(1);
+  futexWakeAll(drainSignal);
+}
@@ -0,0 +1,175 @@
+#ifndef PACKET_DEMUX_HPP
+#define PACKET_DEMUX_HPP
+
+#include "../Message/message.hpp"
+#include "spsc_ring.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using std::string;
+
+// Packets kept per peer while nobody is waiting for them. At least a full
+// receive window, which TCPSocket checks, so flow control keeps a peer below
+// it and only a misbehaving one hits the limit.
+constexpr size_t DEMUX_PENDING_LIMIT = 65536;
+// Packets the listener can queue before it stops reading the socket
+constexpr uint32_t DEMUX_RING_CAPACITY = 8192;
+
+// Bits of DemuxFilter::exact
+constexpr uint8_t DEMUX_EXACT_SEQ = 4;
+constexpr uint8_t DEMUX_EXACT_ACK = 8;
+
+/**
+ * What a consumer waits for. Zero (or an empty ip) means "any", the same
+ * convention TCPSocket::consumeBuffer has always used, unless the field is
+ * marked exact: sequence numbers wrap and 0 is a valid one.
+ */
+struct DemuxFilter
+{
+  string ip;
+  uint16_t port;
+  uint32_t seqNum;
+  uint32_t ackNum;
+  uint8_t flags;
+  uint8_t exact = 0;
+
+  // Bit per specified field: ip, port, seqNum, ackNum, flags
+  uint8_t shape() const;
+  bool matches(const Message &message) const;
+};
+
+/**
+ * Filter for a reply from ip:port with these flags that acknowledges
+ * exactly ackNum, also when it wrapped to 0
+ */
+DemuxFilter exactAck(const string &ip, uint16_t port, uint32_t ackNum,
+                     uint8_t flags);
+
+/**
+ * Demux key: the filter fields selected by shape, everything else zeroed.
+ */
+struct DemuxKey
+{
+  string ip;
+  uint16_t port;
+  uint32_t seqNum;
+  uint32_t ackNum;
+  uint8_t flags;
+  uint8_t shape;
+
+  bool operator==(const DemuxKey &other) const;
+};
+
+struct DemuxKeyHash
+{
+  size_t operator()(const DemuxKey &key) const;
+};
+
+/**
+ * Hands incoming messages to the thread waiting for them.
+ *
+ * The listener thread is the only producer. It pushes into a bounded
+ * lock-free ring and never takes the mutex; when the ring is full it waits
+ * for room, so consumers that fall behind as a whole push back on the
+ * socket. A single peer whose backlog is full loses its newest packets
+ * instead, so one slow session never stalls the others. Consumers drain the
+ * ring under the mutex, one at a time, and sleep on a futex that the
+ * listener bumps per batch.
+ *
+ * Waiters register under the key of their filter, so a drained packet is
+ * matched with one hash lookup per filter shape in use and handed over
+ * directly. Packets nobody waits for yet are kept per peer and indexed by
+ * (flags, ackNum) and (flags, seqNum).
+ *
+ * A peer can be claimed by the thread serving its connection. Its packets
+ * then only go to filters naming that peer, never to wildcard ones.
+ */
+class PacketDemux
+{
+private:
+  struct Waiter
+  {
+    DemuxKey key;
+    Message message;
+    bool filled = false;
+  };
+
+  struct Pending
+  {
+    uint64_t order;
+    Message message;
+  };
+
+  using PendingList = std::list<Pending>;
+  using PendingIndex =
+      std::unordered_map<DemuxKey, std::deque<PendingList::iterator>,
+                         DemuxKeyHash>;
+
+  SpscRing<Message> ring;
+  // Futex words: arrivals is bumped after each delivered batch, drains after
+  // the ring made room for a waiting producer
+  std::atomic<uint32_t> arrivalSignal;
+  std::atomic<uint32_t> drainSignal;
+  std::atomic<uint32_t> sleepers;
+  std::atomic<bool> producerWaiting;
+  std::atomic<bool> closed;
+
+  std::mutex mtx;
+  uint64_t arrivals;
+  std::array<uint32_t, 32> shapeWaiters;
+  std::unordered_map<DemuxKey, std::deque<Waiter *>, DemuxKeyHash> waiters;
+  std::unordered_map<DemuxKey, PendingList, DemuxKeyHash> pendingByPeer;
+  PendingIndex pendingByAck;
+  PendingIndex pendingBySeq;
+  size_t pendingCount;
+  std::unordered_set<DemuxKey, DemuxKeyHash> claimedPeers;
+
+  static DemuxKey project(const Message &message, uint8_t shape);
+  static DemuxKey project(const DemuxFilter &filter);
+  static DemuxKey peerKey(const string &ip, uint16_t port);
+
+  bool enqueue(Message &&message);
+  void signalArrival();
+  void drain();
+  bool isClaimed(const DemuxKey &peer) const;
+  bool handToWaiter(Message &message);
+  void storePending(Message &&message);
+  bool takePending(const DemuxFilter &filter, Message &out);
+  Message removePending(PendingList &list, PendingList::iterator it);
+  void unregister(Waiter &waiter);
+
+public:
+  PacketDemux();
+
+  // Listener thread only
+  void deliver(Message &&message);
+  void deliver(std::vector<Message> &messages);
+
+  /**
+   * Take the oldest message matching filter, waiting until deadline.
+   * Returns false on timeout or once the demux is closed.
+   */
+  bool take(const DemuxFilter &filter, Message &out,
+            std::chrono::steady_clock::time_point deadline);
+
+  // Reserve packets from ip:port for filters that name the peer. Releasing
+  // drops whatever the peer sent that nobody took.
+  void claim(const string &ip, uint16_t port);
+  void release(const string &ip, uint16_t port);
+
+  size_t pending();
+  bool isClosed();
+  void open();
+  void close();
+};
+
+#endif
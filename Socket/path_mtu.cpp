@@ -0,0 +1,66 @@
+#include "path_mtu.hpp"
+#include <algorithm>
+
+PathMtuSearch::PathMtuSearch(uint32_t baseSize, uint32_t maxSize)
+    : confirmedSize(std::min(baseSize, maxSize)), upperBound(maxSize),
+      candidate(maxSize),
+      attempts(0), probeId(0), outstanding(false) {}
+
+bool PathMtuSearch::done() const
+{
+  return upperBound < confirmedSize + PMTU_SEARCH_GRANULARITY;
+}
+
+uint32_t PathMtuSearch::nextProbe(clock::time_point now,
+                                  std::chrono::microseconds timeout,
+                                  uint32_t &id)
+{
+  if (outstanding || done())
+  {
+    return 0;
+  }
+  outstanding = true;
+  attempts++;
+  probeDeadline = now + timeout;
+  id = ++probeId;
+  return candidate;
+}
+
+bool PathMtuSearch::onProbeAck(uint32_t id)
+{
+  // Late answers to earlier attempts of the same candidate count as well
+  if (attempts == 0 || id > probeId || id + attempts <= probeId)
+  {
+    return false;
+  }
+  outstanding = false;
+  attempts = 0;
+  confirmedSize = candidate;
+  candidate = confirmedSize + (upperBound - confirmedSize + 1) / 2;
+  return true;
+}
+
+void PathMtuSearch::lowerBound()
+{
+  attempts = 0;
+  upperBound = candidate - 1;
+  candidate = confirmedSize + (upperBound - confirmedSize + 1) / 2;
+}
+
+void PathMtuSearch::expire(clock::time_point now)
+{
+  if (!outstanding || now < probeDeadline)
+  {
+    return;
+  }
+  outstanding = false;
+  if (attempts >= PMTU_MAX_PROBES)
+  {
+    lowerBound();
+  }
+}
+
+PathMtuSearch::clock::time_point PathMtuSearch::deadline() const
+{
+  return outstanding ? probeDeadline : clock::time_point::max();
+}
@@ -0,0 +1,61 @@
+#ifndef PATH_MTU_HPP
+#define PATH_MTU_HPP
+
+#include <chrono>
+#include <cstdint>
+
+// Probes sent for one size before it counts as too large (MAX_PROBES)
+constexpr uint32_t PMTU_MAX_PROBES = 3;
+// The search stops once the bounds are this close, in payload bytes
+constexpr uint32_t PMTU_SEARCH_GRANULARITY = 32;
+
+/**
+ * Packetization layer path MTU discovery for one connection (RFC 8899).
+ *
+ * Data is only ever sent at a confirmed size. The search sends padding
+ * probes of a candidate size beside the data and raises the confirmed size
+ * when one is acknowledged. A candidate that stays unanswered PMTU_MAX_PROBES
+ * times lowers the upper bound instead. It starts with the largest size the
+ * peer accepts, so paths that carry it take a single round trip, and falls
+ * back to a binary search otherwise. Sizes are payload bytes per segment.
+ */
+class PathMtuSearch
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+private:
+  uint32_t confirmedSize;
+  uint32_t upperBound;
+  uint32_t candidate;
+  uint32_t attempts;
+  uint32_t probeId;
+  bool outstanding;
+  clock::time_point probeDeadline;
+
+  void lowerBound();
+
+public:
+  PathMtuSearch(uint32_t baseSize, uint32_t maxSize);
+
+  bool done() const;
+  uint32_t confirmed() const { return confirmedSize; }
+
+  /**
+   * Size of the probe to send now, 0 while one is outstanding or the search
+   * is over. id is the tag to put on the probe.
+   */
+  uint32_t nextProbe(clock::time_point now, std::chrono::microseconds timeout,
+                     uint32_t &id);
+
+  // The probe tagged id was acknowledged, true if the confirmed size grew
+  bool onProbeAck(uint32_t id);
+
+  // Count the outstanding probe as lost once its deadline has passed
+  void expire(clock::time_point now);
+
+  // When the outstanding probe expires, time_point::max() if there is none
+  clock::time_point deadline() const;
+};
+
+#endif
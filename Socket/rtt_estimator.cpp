@@ -0,0 +1,69 @@
+#include "rtt_estimator.hpp"
+#include <algorithm>
+
+RttEstimator::RttEstimator()
+    : hasSample(false), srtt(0), rttvar(0), rto(RTO_INITIAL) {}
+
+void RttEstimator::updateRto()
+{
+  // Clock granularity is one microsecond, so the 4 * RTTVAR term dominates
+  microseconds base = srtt + std::max(microseconds(1), 4 * rttvar);
+  rto = std::min(std::max(base, RTO_MIN), RTO_MAX);
+}
+
+void RttEstimator::addSample(microseconds sample)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  if (sample.count() < 0)
+  {
+    return;
+  }
+  if (!hasSample)
+  {
+    srtt = sample;
+    rttvar = sample / 2;
+    hasSample = true;
+  }
+  else
+  {
+    microseconds error = srtt > sample ? srtt - sample : sample - srtt;
+    rttvar = (3 * rttvar + error) / 4;
+    srtt = (7 * srtt + sample) / 8;
+  }
+  updateRto();
+}
+
+void RttEstimator::addSample(microseconds sample, bool retransmitted)
+{
+  if (!retransmitted)
+  {
+    addSample(sample);
+  }
+}
+
+void RttEstimator::backoff()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  rto = std::min(rto * 2, RTO_MAX);
+}
+
+void RttEstimator::reset()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  hasSample = false;
+  srtt = microseconds(0);
+  rttvar = microseconds(0);
+  rto = RTO_INITIAL;
+}
+
+microseconds RttEstimator::getRto()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return rto;
+}
+
+microseconds RttEstimator::getSrtt()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return srtt;
+}
@@ -0,0 +1,45 @@
+#ifndef RTT_ESTIMATOR_HPP
+#define RTT_ESTIMATOR_HPP
+
+#include <chrono>
+#include <mutex>
+
+using std::chrono::microseconds;
+
+// Bounds for the retransmission timeout
+constexpr microseconds RTO_INITIAL(1000000);
+constexpr microseconds RTO_MIN(10000);
+constexpr microseconds RTO_MAX(60000000);
+
+/**
+ * Smoothed RTT and RTT variance per connection (RFC 6298).
+ *
+ * Karn's rule: a segment that was retransmitted gives no sample, since the
+ * ACK may answer either copy. Every timeout doubles the RTO until the next
+ * valid sample brings it back.
+ */
+class RttEstimator
+{
+private:
+  std::mutex mtx;
+  bool hasSample;
+  microseconds srtt;
+  microseconds rttvar;
+  microseconds rto;
+
+  void updateRto();
+
+public:
+  RttEstimator();
+
+  void addSample(microseconds sample);
+  // Time from a segment's first send to its ACK, ignored if it was resent
+  void addSample(microseconds sample, bool retransmitted);
+  void backoff();
+  void reset();
+
+  microseconds getRto();
+  microseconds getSrtt();
+};
+
+#endif
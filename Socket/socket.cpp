@@ -1,26 +1,117 @@
 #include "socket.hpp"
+#include <cerrno>
 #include <chrono>
 #include <iostream>
 #include <iterator>
+#include <linux/filter.h>
 #include <sys/types.h>
 
+ConnectionState::ConnectionState()
+    : status(TCPStatusEnum::CLOSED), arqMode(ArqMode::GO_BACK_N),
+      congestionAlgorithm(CongestionAlgorithm::NEW_RENO),
+      peerWindow(RECEIVE_WINDOW), sendWindowShift(0), receiveWindowShift(0),
+      maxPayload(MAX_PAYLOAD_SIZE), stream{0, 1, 0, 0}
+{
+}
+
+void ConnectionState::configureLike(const ConnectionState &defaults)
+{
+  arqMode = defaults.arqMode;
+  setCongestionControl(defaults.congestionAlgorithm);
+}
+
+void ConnectionState::setCongestionControl(CongestionAlgorithm algo)
+{
+  congestionAlgorithm = algo;
+  handler.setCongestionControl(algo);
+}
+
+// Smallest shift that fits RECEIVE_WINDOW into the 16 bit window field
+static uint8_t localWindowShift()
+{
+  uint8_t shift = 0;
+  while ((RECEIVE_WINDOW >> shift) > 0xFFFF && shift < MAX_WINDOW_SCALE)
+  {
+    shift++;
+  }
+  return shift;
+}
+
+void ConnectionState::offerWindowScale(Segment &segment)
+{
+  setWindowScale(segment, localWindowShift());
+}
+
+void ConnectionState::acceptWindowScale(const Segment &peerSegment)
+{
+  uint8_t shift = 0;
+  if (getWindowScale(peerSegment, shift))
+  {
+    sendWindowShift = shift;
+    receiveWindowShift = localWindowShift();
+  }
+  else
+  {
+    sendWindowShift = 0;
+    receiveWindowShift = 0;
+  }
+}
+
+uint16_t ConnectionState::encodeWindow(uint32_t window) const
+{
+  // Round up so a nearly full buffer is not advertised as closed
+  uint32_t scaled =
+      (window + (1u << receiveWindowShift) - 1) >> receiveWindowShift;
+  return (uint16_t)std::min(scaled, 0xFFFFu);
+}
+
+uint32_t ConnectionState::decodeWindow(uint16_t window) const
+{
+  return (uint32_t)window << sendWindowShift;
+}
+
+void ConnectionState::acceptMaxSegmentSize(const Segment &peerSegment,
+                                           uint32_t localMax)
+{
+  uint32_t peerMax = MAX_PAYLOAD_SIZE;
+  getMaxSegmentSize(peerSegment, peerMax);
+  maxPayload = std::max(std::min(localMax, peerMax), BASE_PAYLOAD_SIZE);
+}
+
 TCPSocket::TCPSocket(const string &ip, int port)
-    : ip(ip), port(port), isListening(false)
+    : ip(ip), port(port),
+      recvPool(new RecvBufferPool(RECV_POOL_SLOTS, MAX_DATAGRAM_SIZE)),
+      maxPayload(MAX_PAYLOAD_SIZE), pathMtuProbing(false),
+      segmentOffload(false), receiveOffload(false), isListening(false),
+      cachedDestPort(0), cachedDestAddress{}
 {
   sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd < 0)
   {
     throw std::runtime_error("Socket creation failed.");
   }
-  status = TCPStatusEnum::CLOSED;
-  sh = new SegmentHandler();
+
+  // Default UDP buffers hold a couple hundred segments, far below a scaled
+  // window. The FORCE variants need CAP_NET_ADMIN, otherwise rmem_max caps us
+  int bufferSize = SOCKET_BUFFER_SIZE;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &bufferSize,
+                 sizeof(bufferSize)) < 0)
+  {
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+  }
+  if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &bufferSize,
+                 sizeof(bufferSize)) < 0)
+  {
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+  }
+
+  setReceiveBatch(RECV_BATCH_SIZE);
 }
 
 TCPSocket::~TCPSocket()
 {
   stopListening();
   close();
-  delete sh;
 }
 
 void TCPSocket::listen()
@@ -57,6 +148,92 @@ void TCPSocket::setBroadcast()
   }
 }
 
+void TCPSocket::setMaxPayload(uint32_t size)
+{
+  if (isListening)
+  {
+    throw std::runtime_error("Payload size must be set before listening");
+  }
+  maxPayload = std::min(std::max(size, BASE_PAYLOAD_SIZE),
+                        MAX_JUMBO_PAYLOAD_SIZE);
+  resizeRecvPool();
+}
+
+void TCPSocket::setPathMtuProbing(bool enable)
+{
+  if (isListening)
+  {
+    throw std::runtime_error("Path MTU probing must be set before listening");
+  }
+  // Probing needs DF and no fragmentation, a datagram too large for the path
+  // must be lost instead. Otherwise leave the kernel's default behaviour.
+  int discovery = enable ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+  setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &discovery,
+             sizeof(discovery));
+  pathMtuProbing = enable;
+}
+
+bool TCPSocket::setOffload(bool enable)
+{
+  if (isListening)
+  {
+    throw std::runtime_error("Offload must be set before listening");
+  }
+  // Kernels without UDP GSO reject the option, 0 leaves sends unsegmented
+  int off = 0;
+  segmentOffload = enable && setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &off,
+                                        sizeof(off)) == 0;
+  int on = enable ? 1 : 0;
+  receiveOffload =
+      setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0 && enable;
+  resizeRecvPool();
+  return !enable || (segmentOffload && receiveOffload);
+}
+
+void TCPSocket::resizeRecvPool()
+{
+  if (receiveOffload)
+  {
+    recvPool.reset(new RecvBufferPool(GRO_POOL_SLOTS, GRO_BUFFER_SIZE));
+  }
+  else
+  {
+    recvPool.reset(
+        new RecvBufferPool(RECV_POOL_SLOTS, MAX_HEADER_SIZE + maxPayload));
+  }
+}
+
+void TCPSocket::setReusePort()
+{
+  int enable = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) <
+      0)
+  {
+    throw std::runtime_error("Failed to enable SO_REUSEPORT");
+  }
+}
+
+bool TCPSocket::steerByPeerPort(uint32_t groupSize)
+{
+  // Source port right after the IPv4 header, whose length comes from its
+  // IHL field since options make it longer than 20 bytes. Anything that is
+  // not IPv4 goes to the first socket. The program's return value is the
+  // index of the socket that gets the datagram.
+  sock_filter program[] = {
+      {BPF_LD | BPF_B | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF},
+      {BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4},
+      {BPF_JMP | BPF_JEQ | BPF_K, 0, 4, 4},
+      {BPF_LDX | BPF_B | BPF_MSH, 0, 0, (uint32_t)SKF_NET_OFF},
+      {BPF_LD | BPF_H | BPF_IND, 0, 0, (uint32_t)SKF_NET_OFF},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, groupSize},
+      {BPF_RET | BPF_A, 0, 0, 0},
+      {BPF_RET | BPF_K, 0, 0, 0},
+  };
+  sock_fprog filter = {sizeof(program) / sizeof(program[0]), program};
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &filter,
+                    sizeof(filter)) == 0;
+}
+
 sockaddr_in TCPSocket::createSockAddr(const string &ipAddress, int port)
 {
   sockaddr_in address = {};
@@ -81,14 +258,156 @@ bool TCPSocket::send(const string &destinationIP, int32_t destinationPort,
   return true;
 }
 
+sockaddr_in TCPSocket::resolveDestination(const string &destinationIP,
+                                          uint16_t destinationPort)
+{
+  lock_guard<mutex> lock(sendMutex);
+  if (destinationPort != cachedDestPort || destinationIP != cachedDestIP)
+  {
+    cachedDestAddress = createSockAddr(destinationIP, destinationPort);
+    cachedDestIP = destinationIP;
+    cachedDestPort = destinationPort;
+  }
+  return cachedDestAddress;
+}
+
 void TCPSocket::sendSegment(const Segment &segment, const string &destinationIP,
                             uint16_t destinationPort)
 {
-  uint32_t segmentSize = segment.payloadSize + 24;
-  auto *buffer = new uint8_t[segmentSize];
-  encodeSegment(segment, buffer);
-  send(destinationIP, destinationPort, buffer, segmentSize);
-  delete[] buffer;
+  sockaddr_in destAddress = resolveDestination(destinationIP, destinationPort);
+
+  // Header from the stack, payload straight from the segment
+  uint8_t header[MAX_HEADER_SIZE];
+  encodeHeader(segment, header);
+  iovec parts[2] = {{header, headerLength(segment)},
+                    {segment.payload, segment.payloadSize}};
+
+  msghdr message = {};
+  message.msg_name = &destAddress;
+  message.msg_namelen = sizeof(destAddress);
+  message.msg_iov = parts;
+  message.msg_iovlen = segment.payloadSize > 0 ? 2 : 1;
+  sendmsg(sockfd, &message, 0);
+}
+
+void TCPSocket::sendSegments(const vector<const Segment *> &segments,
+                             const string &destinationIP,
+                             uint16_t destinationPort)
+{
+  if (segments.empty())
+  {
+    return;
+  }
+  sockaddr_in destAddress = resolveDestination(destinationIP, destinationPort);
+
+  lock_guard<mutex> lock(sendMutex);
+  size_t count = segments.size();
+  if (sendHeaders.size() < count)
+  {
+    sendHeaders.resize(count);
+    sendIovecs.resize(count * 2);
+    sendMsgs.resize(count);
+    sendControls.resize(count);
+  }
+
+  // Header and payload of every segment sit next to each other in
+  // sendIovecs, so consecutive segments form one contiguous super-buffer
+  for (size_t i = 0; i < count; i++)
+  {
+    const Segment &segment = *segments[i];
+    encodeHeader(segment, sendHeaders[i].data());
+    sendIovecs[i * 2] = {sendHeaders[i].data(), headerLength(segment)};
+    sendIovecs[i * 2 + 1] = {segment.payload, segment.payloadSize};
+  }
+
+  size_t first = 0;
+  while (first < count)
+  {
+    size_t messages = packSendMessages(segments, first, destAddress);
+
+    // sendmmsg may stop early when the socket buffer fills, resume from there
+    size_t sent = 0;
+    int error = 0;
+    while (sent < messages)
+    {
+      int result = sendmmsg(sockfd, &sendMsgs[sent], messages - sent, 0);
+      if (result <= 0)
+      {
+        error = result < 0 ? errno : 0;
+        if (error == EINTR)
+        {
+          continue;
+        }
+        break;
+      }
+      sent += result;
+    }
+    if (sent == messages || !segmentOffload ||
+        (error != EIO && error != EINVAL))
+    {
+      return;
+    }
+
+    // The route cannot segment for us, e.g. no checksum offload on the
+    // device. Send the rest, and everything after, one datagram at a time.
+    segmentOffload = false;
+    std::cout << ERROR << " UDP segmentation offload failed, sending datagrams one by one." << endl;
+    first = (sendMsgs[sent].msg_hdr.msg_iov - sendIovecs.data()) / 2;
+  }
+}
+
+size_t TCPSocket::packSendMessages(const vector<const Segment *> &segments,
+                                   size_t first, sockaddr_in &destAddress)
+{
+  size_t messages = 0;
+  size_t i = first;
+  while (i < segments.size())
+  {
+    uint32_t frame = headerLength(*segments[i]) + segments[i]->payloadSize;
+    size_t group = 1;
+    if (segmentOffload)
+    {
+      // The kernel cuts the super-buffer every frame bytes, so only the last
+      // datagram of a run may be shorter than the first
+      size_t limit = std::max<size_t>(
+          1, std::min<size_t>(GSO_MAX_SEGMENTS, GSO_MAX_BYTES / frame));
+      while (group < limit && i + group < segments.size())
+      {
+        const Segment &next = *segments[i + group];
+        uint32_t nextFrame = headerLength(next) + next.payloadSize;
+        if (nextFrame > frame)
+        {
+          break;
+        }
+        group++;
+        if (nextFrame < frame)
+        {
+          break;
+        }
+      }
+    }
+
+    msghdr &message = sendMsgs[messages].msg_hdr;
+    message = {};
+    message.msg_name = &destAddress;
+    message.msg_namelen = sizeof(destAddress);
+    message.msg_iov = &sendIovecs[i * 2];
+    message.msg_iovlen = group * 2;
+    if (group > 1)
+    {
+      message.msg_control = sendControls[messages].data;
+      message.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      cmsghdr *control = CMSG_FIRSTHDR(&message);
+      control->cmsg_level = SOL_UDP;
+      control->cmsg_type = UDP_SEGMENT;
+      control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t segmentSize = (uint16_t)frame;
+      memcpy(CMSG_DATA(control), &segmentSize, sizeof(segmentSize));
+    }
+    messages++;
+    i += group;
+  }
+  return messages;
 }
 
 int32_t TCPSocket::receive(void *buffer, uint32_t bufferSize, bool peek)
@@ -101,42 +420,32 @@ int32_t TCPSocket::receive(void *buffer, uint32_t bufferSize, bool peek)
                   (struct sockaddr *)&sourceAddress, &addressLength);
 }
 
+void TCPSocket::setReceiveBatch(uint32_t batchSize)
+{
+  receiveBatchSize = std::max<uint32_t>(batchSize, 1);
+  recvBuffers.clear();
+  recvBuffers.resize(receiveBatchSize);
+  recvHeaders.assign(receiveBatchSize, mmsghdr{});
+  recvIovecs.assign(receiveBatchSize, iovec{});
+  recvAddresses.assign(receiveBatchSize, sockaddr_in{});
+  recvControls.assign(receiveBatchSize, OffloadControl{});
+  recvReady.reserve(receiveBatchSize);
+}
+
 void TCPSocket::produceBuffer()
 {
   while (isListening)
   {
     try
     {
-      uint8_t *dataBuffer = new uint8_t[MAX_SEGMENT_SIZE];
-      sockaddr_in clientAddress;
-      socklen_t addressLength = sizeof(clientAddress);
-
-      int bytesRead =
-          recvfrom(sockfd, dataBuffer, MAX_SEGMENT_SIZE, 0,
-                   (struct sockaddr *)&clientAddress, &addressLength);
-      if (bytesRead <= 0)
+      // Coalesced receives need the control data only recvmmsg asks for
+      if (receiveBatchSize > 1 || receiveOffload)
       {
-        delete[] dataBuffer;
-        if (!isListening)
-          break;
-        continue;
+        receiveBatch();
       }
-
-      Segment segment = decodeSegment(dataBuffer, bytesRead);
-      delete[] dataBuffer;
-
-      if (!isValidChecksum(segment))
+      else
       {
-        continue;
-      }
-
-      Message message(inet_ntoa(clientAddress.sin_addr),
-                      ntohs(clientAddress.sin_port), segment);
-
-      {
-        lock_guard<mutex> lock(bufferMutex);
-        packetBuffer.push_back(std::move(message));
-        bufferCondition.notify_one();
+        receiveSingle();
       }
     }
     catch (const std::exception &ex)
@@ -149,58 +458,231 @@ void TCPSocket::produceBuffer()
   }
 }
 
-Message TCPSocket::consumeBuffer(const string &filterIP, uint16_t filterPort,
-                                 uint32_t filterSeqNum, uint32_t filterAckNum,
-                                 uint8_t filterFlags, int timeout)
+void TCPSocket::receiveSingle()
 {
-  auto start = std::chrono::steady_clock::now();
-  auto timeoutPoint = (timeout > 0)
-                          ? start + std::chrono::seconds(timeout)
-                          : std::chrono::steady_clock::time_point::max();
-  while (isListening)
+  RecvBufferRef dataBuffer = recvPool->acquire();
+  sockaddr_in clientAddress;
+  socklen_t addressLength = sizeof(clientAddress);
+
+  int bytesRead =
+      recvfrom(sockfd, dataBuffer.data(), dataBuffer.capacity(), 0,
+               (struct sockaddr *)&clientAddress, &addressLength);
+  if (bytesRead <= 0)
+  {
+    return;
+  }
+
+  // The payload stays in the pooled slot until the last Message drops it
+  SegmentView segment;
+  if (!decodeSegmentView(dataBuffer, bytesRead, segment))
+  {
+    return;
+  }
+
+  Message message(inet_ntoa(clientAddress.sin_addr),
+                  ntohs(clientAddress.sin_port), std::move(segment));
+
+  demux.deliver(std::move(message));
+}
+
+// Length of each datagram in a UDP GRO receive, the kernel reports it when it
+// coalesced several. Otherwise the buffer holds one datagram of length bytes.
+static uint32_t coalescedStride(msghdr &header, uint32_t length)
+{
+  for (cmsghdr *control = CMSG_FIRSTHDR(&header); control != nullptr;
+       control = CMSG_NXTHDR(&header, control))
+  {
+    if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+    {
+      int segmentSize = 0;
+      memcpy(&segmentSize, CMSG_DATA(control), sizeof(segmentSize));
+      if (segmentSize > 0)
+      {
+        return (uint32_t)segmentSize;
+      }
+    }
+  }
+  return length;
+}
+
+void TCPSocket::receiveBatch()
+{
+  for (uint32_t i = 0; i < receiveBatchSize; i++)
   {
-    std::unique_lock<mutex> lock(bufferMutex);
-    bufferCondition.wait_for(lock, std::chrono::milliseconds(100),
-                             [this]()
-                             { return !packetBuffer.empty(); });
-    for (auto it = packetBuffer.begin(); it != packetBuffer.end(); ++it)
-    {
-      const auto &msg = *it;
-      if ((filterIP.empty() || msg.ip == filterIP) &&
-          (filterPort == 0 || msg.port == filterPort) &&
-          (filterSeqNum == 0 || msg.segment.seqNum == filterSeqNum) &&
-          (filterAckNum == 0 || msg.segment.ackNum == filterAckNum) &&
-          (filterFlags == 0 || getFlags8(&msg.segment) == filterFlags))
+    // Slots handed to a Message last round are replaced, the rest are reused
+    if (!recvBuffers[i].valid())
+    {
+      recvBuffers[i] = recvPool->acquire();
+    }
+    recvIovecs[i].iov_base = recvBuffers[i].data();
+    recvIovecs[i].iov_len = recvBuffers[i].capacity();
+    recvHeaders[i].msg_hdr.msg_name = &recvAddresses[i];
+    recvHeaders[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    recvHeaders[i].msg_hdr.msg_iov = &recvIovecs[i];
+    recvHeaders[i].msg_hdr.msg_iovlen = 1;
+    recvHeaders[i].msg_hdr.msg_control =
+        receiveOffload ? recvControls[i].data : nullptr;
+    recvHeaders[i].msg_hdr.msg_controllen =
+        receiveOffload ? sizeof(recvControls[i].data) : 0;
+    recvHeaders[i].msg_hdr.msg_flags = 0;
+  }
+
+  int received = recvmmsg(sockfd, recvHeaders.data(), receiveBatchSize,
+                          MSG_WAITFORONE, nullptr);
+  if (received <= 0)
+  {
+    return;
+  }
+
+  recvReady.clear();
+  for (int i = 0; i < received; i++)
+  {
+    uint32_t length = recvHeaders[i].msg_len;
+    uint32_t stride =
+        receiveOffload ? coalescedStride(recvHeaders[i].msg_hdr, length)
+                       : length;
+    string sourceIP = inet_ntoa(recvAddresses[i].sin_addr);
+    uint16_t sourcePort = ntohs(recvAddresses[i].sin_port);
+    size_t before = recvReady.size();
+    // Every datagram of a coalesced receive becomes its own view of the slot
+    for (uint32_t offset = 0; offset < length; offset += stride)
+    {
+      uint32_t size = std::min(stride, length - offset);
+      SegmentView segment;
+      if (!decodeSegmentView(recvBuffers[i], offset, size, segment))
       {
-        Message result = std::move(*it);
-        packetBuffer.erase(it);
-        return result;
+        continue;
       }
+      recvReady.emplace_back(sourceIP, sourcePort, std::move(segment));
     }
-    if (timeout > 0 && std::chrono::steady_clock::now() > timeoutPoint)
+    if (recvReady.size() > before)
     {
-      throw std::runtime_error("Buffer consumer timeout.");
+      recvBuffers[i].reset();
     }
   }
 
-  throw std::runtime_error("Socket is no longer listening.");
+  if (recvReady.empty())
+  {
+    return;
+  }
+
+  // One lock for the whole batch, each packet wakes only its own waiter
+  demux.deliver(recvReady);
+  recvReady.clear();
 }
 
-void TCPSocket::setStatus(TCPStatusEnum newState) { status = newState; }
+Message TCPSocket::consumeBuffer(const string &filterIP, uint16_t filterPort,
+                                 uint32_t filterSeqNum, uint32_t filterAckNum,
+                                 uint8_t filterFlags, int timeout)
+{
+  return consumeBuffer(DemuxFilter{filterIP, filterPort, filterSeqNum,
+                                   filterAckNum, filterFlags},
+                       timeout);
+}
 
-TCPStatusEnum TCPSocket::getStatus() const { return status; }
+Message TCPSocket::consumeBuffer(const DemuxFilter &filter, int timeout)
+{
+  auto timeoutPoint = (timeout > 0)
+                          ? std::chrono::steady_clock::now() +
+                                std::chrono::seconds(timeout)
+                          : std::chrono::steady_clock::now() +
+                                std::chrono::hours(24 * 365);
+  Message result;
+  if (demux.take(filter, result, timeoutPoint))
+  {
+    return result;
+  }
+  if (!isListening || demux.isClosed())
+  {
+    throw std::runtime_error("Socket is no longer listening.");
+  }
+  throw std::runtime_error("Buffer consumer timeout.");
+}
+
+void TCPSocket::setArqMode(ArqMode mode) { state.arqMode = mode; }
+
+void TCPSocket::addRttSample(microseconds sample)
+{
+  state.rtt.addSample(sample);
+}
+
+void TCPSocket::setCongestionControl(CongestionAlgorithm algo)
+{
+  state.setCongestionControl(algo);
+}
+
+void TCPSocket::setPeerWindow(uint32_t window) { state.peerWindow = window; }
+
+void TCPSocket::claimPeer(const string &peerIP, uint16_t peerPort)
+{
+  demux.claim(peerIP, peerPort);
+}
+
+void TCPSocket::releasePeer(const string &peerIP, uint16_t peerPort)
+{
+  demux.release(peerIP, peerPort);
+}
+
+void TCPSocket::offerWindowScale(Segment &segment)
+{
+  ConnectionState::offerWindowScale(segment);
+}
+
+void TCPSocket::acceptWindowScale(const Segment &peerSegment)
+{
+  state.acceptWindowScale(peerSegment);
+}
+
+uint16_t TCPSocket::encodeWindow(uint32_t window) const
+{
+  return state.encodeWindow(window);
+}
+
+uint32_t TCPSocket::decodeWindow(uint16_t window) const
+{
+  return state.decodeWindow(window);
+}
+
+uint32_t TCPSocket::receiveWindow(size_t held)
+{
+  // Both the segments still queued in the demux and the ones buffered out
+  // of order occupy the receive buffer
+  size_t used = held + demux.pending();
+  return used >= RECEIVE_WINDOW ? 0 : RECEIVE_WINDOW - (uint32_t)used;
+}
+
+void TCPSocket::offerMaxSegmentSize(Segment &segment) const
+{
+  setMaxSegmentSize(segment, maxPayload);
+}
+
+void TCPSocket::acceptMaxSegmentSize(const Segment &peerSegment)
+{
+  state.acceptMaxSegmentSize(peerSegment, maxPayload);
+}
+
+void TCPSocket::setStatus(TCPStatusEnum newState) { state.status = newState; }
+
+TCPStatusEnum TCPSocket::getStatus() const { return state.status; }
 
 void TCPSocket::startListening()
 {
   isListening = true;
+  demux.open();
   listenerThread = std::thread(&TCPSocket::produceBuffer, this);
 }
 
 void TCPSocket::stopListening()
 {
   isListening = false;
+  demux.close();
   if (listenerThread.joinable())
   {
+    // Wake the listener out of its blocking receive
+    if (sockfd >= 0)
+    {
+      shutdown(sockfd, SHUT_RD);
+    }
     listenerThread.join();
   }
 }
@@ -215,96 +697,385 @@ void TCPSocket::close()
   }
 }
 
-ConnectionResult TCPSocket::sendBackN(uint8_t *dataStream, uint32_t dataSize,
+ConnectionResult TCPSocket::sendBackN(uint8_t *dataStream, uint64_t dataSize,
                                       const string &destIP, uint16_t destPort,
                                       uint32_t startingSeqNum, bool isFile,
                                       string fileFullName)
 {
-  sh->setDataStream(dataStream, dataSize, startingSeqNum, port, destPort);
+  MemorySource source(dataStream, dataSize);
+  return sendBackN(source, destIP, destPort, startingSeqNum, isFile,
+                   fileFullName);
+}
+
+ConnectionResult TCPSocket::sendBackN(DataSource &source, const string &destIP,
+                                      uint16_t destPort,
+                                      uint32_t startingSeqNum, bool isFile,
+                                      string fileFullName)
+{
+  return sendBackN(state, source, destIP, destPort, startingSeqNum, isFile,
+                   fileFullName);
+}
+
+ConnectionResult TCPSocket::sendBackN(ConnectionState &connection,
+                                      DataSource &source, const string &destIP,
+                                      uint16_t destPort,
+                                      uint32_t startingSeqNum, bool isFile,
+                                      string fileFullName)
+{
+  SegmentHandler *sh = &connection.handler;
+  RttEstimator &rtt = connection.rtt;
+  uint32_t &peerWindow = connection.peerWindow;
+  const TCPStatusEnum &status = connection.status;
+  sh->setDataSource(source, startingSeqNum, port, destPort);
+  // With probing, data starts at a size every path carries and probes raise
+  // it as far as the path and the peer allow. Without, the search is done
+  // from the start at the negotiated size and sends no probes.
+  PathMtuSearch pathMtu(pathMtuProbing ? BASE_PAYLOAD_SIZE
+                                       : connection.maxPayload,
+                        connection.maxPayload);
+  sh->setSegmentSize(pathMtu.confirmed());
   if (isFile)
   {
     sh->addMetadata(fileFullName, port, destPort);
   }
   sh->markEOF();
 
-  vector<thread> threads;
-  std::atomic<bool> retry(false);
-  while (true)
+  // Single event loop: fill the window, then block until either an ACK
+  // arrives or the retransmission timer of the oldest segment fires
+  using clock = std::chrono::steady_clock;
+  DemuxFilter ackFilter{destIP, destPort, 0, 0, ACK_FLAG};
+  vector<const Segment *> batch;
+  // Retransmission timers in send order. Go-Back-N only acts on the oldest
+  // one, Selective Repeat resends just the segment whose timer fired.
+  std::deque<std::pair<clock::time_point, uint32_t>> timers;
+  // First send time of each outstanding segment and whether it was resent
+  std::unordered_map<uint32_t, std::pair<clock::time_point, bool>> sendTimes;
+  int timeouts = 0;
+  CongestionControl &congestion = sh->getCongestionControl();
+  // Loss detection by duplicate ACKs, recovery lasts until everything that
+  // was outstanding when the loss was detected is acknowledged (NewReno)
+  uint32_t dupAcks = 0;
+  bool inRecovery = false;
+  uint32_t recoverSeqNum = 0;
+
+  auto retransmit = [&](uint32_t seqNum, const string &reason)
+  {
+    Segment *seg = sh->segmentAt(seqNum);
+    if (seg == nullptr || sh->isAcked(seqNum) ||
+        seqGt(seqNum, sh->getCurrentSeqNum()))
+    {
+      return;
+    }
+    std::cout << OUT << brackets(reason)
+              << brackets("Seq " + std::to_string(seqNum - startingSeqNum))
+              << brackets("S=" + std::to_string(seqNum)) << "Resent" << endl;
+    sendSegment(*seg, destIP, destPort);
+    sendTimes[seqNum].second = true;
+    timers.emplace_back(clock::now() + rtt.getRto(), seqNum);
+  };
+
+  // Zero window probing, reset whenever the receiver answers
+  microseconds persistTimeout = rtt.getRto();
+  int probes = 0;
+
+  // Any ACK >= n acknowledges every segment below n in one step
+  auto processAck = [&, arqModeNow = connection.arqMode](const Message &result)
+  {
+    // Probe answers say nothing about the data
+    uint32_t probeId = 0;
+    if (getPathProbe(result.segment, probeId))
+    {
+      if (pathMtu.onProbeAck(probeId))
+      {
+        sh->setSegmentSize(pathMtu.confirmed());
+        std::cout << IN << brackets("PMTU")
+                  << brackets("MSS=" + std::to_string(pathMtu.confirmed()))
+                  << "Probe acknowledged" << endl;
+      }
+      return false;
+    }
+    uint32_t previousAckNum = sh->getCurrentAckNum();
+    uint32_t newlyAcked = sh->acknowledge(result.segment.ackNum);
+    // Reordered older ACKs carry a stale window, ignore it
+    if (seqGeq(result.segment.ackNum - 1, previousAckNum))
+    {
+      peerWindow = connection.decodeWindow(result.segment.window);
+    }
+    if (arqModeNow == ArqMode::SELECTIVE_REPEAT &&
+        sh->markAcked(result.segment.seqNum))
+    {
+      newlyAcked++;
+    }
+
+    // The ACK names the segment that triggered it, the estimator drops the
+    // sample if that segment was resent (Karn's rule)
+    auto sent = sendTimes.find(result.segment.seqNum);
+    if (newlyAcked > 0 && sent != sendTimes.end())
+    {
+      rtt.addSample(std::chrono::duration_cast<microseconds>(
+                        clock::now() - sent->second.first),
+                    sent->second.second);
+    }
+    if (sent != sendTimes.end())
+    {
+      sendTimes.erase(sent);
+    }
+    uint32_t ackNum = sh->getCurrentAckNum();
+    for (uint32_t seqNum = previousAckNum + 1; seqLeq(seqNum, ackNum);
+         seqNum++)
+    {
+      sendTimes.erase(seqNum);
+    }
+    newlyAcked += sh->applySack(getSackBlocks(result.segment));
+
+    if (ackNum != previousAckNum)
+    {
+      dupAcks = 0;
+      if (inRecovery && seqGeq(ackNum, recoverSeqNum))
+      {
+        inRecovery = false;
+      }
+      else if (inRecovery)
+      {
+        // Partial ACK: the next hole was lost as well
+        retransmit(ackNum + 1, "FAST RETRANSMIT");
+      }
+    }
+    else if (result.segment.ackNum == ackNum + 1 &&
+             seqLt(ackNum, sh->getCurrentSeqNum()) &&
+             ++dupAcks == DUP_ACK_THRESHOLD && !inRecovery)
+    {
+      congestion.onLoss(sh->getCurrentSeqNum() - ackNum);
+      inRecovery = true;
+      recoverSeqNum = sh->getCurrentSeqNum();
+      retransmit(ackNum + 1, "FAST RETRANSMIT");
+    }
+    if (newlyAcked > 0 && !inRecovery)
+    {
+      congestion.onAck(newlyAcked, rtt.getSrtt());
+    }
+
+    if (newlyAcked > 0)
+    {
+      std::cout << IN << brackets(status_strings[(int)status])
+                << brackets("A=" + std::to_string(result.segment.ackNum)) +
+                       "Received ACK request from " + result.ip + ":" +
+                       std::to_string(result.port)
+                << std::endl;
+    }
+    return newlyAcked > 0;
+  };
+  while (!sh->isFinished(startingSeqNum))
   {
-    while (sh->getCurrentSeqNum() - sh->getCurrentAckNum() <
-           sh->getWindowSize())
+    if (sh->hasReadError())
+    {
+      commandLine('!', "[ERROR] Failed to read the data to send");
+      return ConnectionResult(false, destIP, destPort, 0, 0);
+    }
+    batch.clear();
+    // In flight is bounded by both the network and the receiver's buffer
+    uint32_t window = std::min(sh->getWindowSize(), peerWindow);
+    while (sh->getCurrentSeqNum() - sh->getCurrentAckNum() < window)
     {
       Segment *seg = sh->advanceWindow(1);
       if (seg == nullptr)
       {
         break;
       }
-      threads.emplace_back([this, seg = *seg, destIP, destPort, startingSeqNum,
-                            &retry]()
-                           {
-        try {
-          std::cout << OUT << brackets(status_strings[(int)status])
-                    << brackets("Seq " +
-                                std::to_string(seg.seqNum - startingSeqNum))
-                    << brackets("S=" + std::to_string(seg.seqNum)) << "Sent"
-                    << endl;
-          sendSegment(seg, destIP, destPort);
-
-          Message result =
-              consumeBuffer(destIP, destPort, 0, seg.seqNum + 1, ACK_FLAG, 1);
-
-          std::cout << IN
-                    << brackets(status_strings[(int)status])<<brackets("A=" +
-                           std::to_string(result.segment.ackNum))+
-                           "Received ACK request from " + result.ip + ":" +
-                           std::to_string(result.port)
-                    << std::endl;
-          ;
-          sh->ackWindow(seg.seqNum);
-        } catch (const std::runtime_error &e) {
-          std::cout << OUT << brackets("TIMEOUT")
-                    << brackets("Seq " +
-                                std::to_string(seg.seqNum - startingSeqNum))
-                    << brackets("S=" + std::to_string(seg.seqNum)) << "Timeout"
-                    << endl;
-          if (sh->getCurrentAckNum() + 1 == seg.seqNum) {
-            retry = true;
-            sh->goBackWindow();
-          }
-        } });
+      // The scoreboard says the receiver already holds it
+      if (sh->isAcked(seg->seqNum))
+      {
+        continue;
+      }
+      batch.push_back(seg);
     }
-    if (sh->isFinished(startingSeqNum))
+
+    // Flush everything the window opened up with one sendmmsg
+    auto now = clock::now();
+    auto deadline = now + rtt.getRto();
+    for (const Segment *seg : batch)
     {
-      break;
+      auto sent = sendTimes.emplace(seg->seqNum, std::make_pair(now, false));
+      if (!sent.second)
+      {
+        sent.first->second.second = true;
+      }
+      std::cout << OUT << brackets(status_strings[(int)status])
+                << brackets("Seq " +
+                            std::to_string(seg->seqNum - startingSeqNum))
+                << brackets("S=" + std::to_string(seg->seqNum)) << "Sent"
+                << endl;
+      timers.emplace_back(deadline, seg->seqNum);
     }
+    sendSegments(batch, destIP, destPort);
 
-    if (retry)
+    // Path MTU probes ride beside the data and take no congestion window.
+    // ACKs keep the wait below from timing out, so lost probes expire here.
+    pathMtu.expire(now);
+    uint32_t probeId = 0;
+    uint32_t probeSize = pathMtu.nextProbe(now, rtt.getRto(), probeId);
+    if (probeSize > 0)
     {
-      for (auto &t : threads)
+      Segment probe = pathProbe(probeId, sh->getCurrentAckNum(), probeSize);
+      std::cout << OUT << brackets("PMTU")
+                << brackets("MSS=" + std::to_string(probeSize)) << "Probe sent"
+                << endl;
+      sendSegment(probe, destIP, destPort);
+    }
+
+    while (!timers.empty() && sh->isAcked(timers.front().second))
+    {
+      timers.pop_front();
+    }
+    if (timers.empty() && sh->isFinished(startingSeqNum))
+    {
+      continue;
+    }
+
+    // Nothing left to time out means the receiver closed its window, so
+    // the persist timer decides when to probe it
+    bool windowClosed = timers.empty();
+    auto dataWakeUp = windowClosed ? clock::now() + persistTimeout
+                                   : timers.front().first;
+    auto wakeUp = std::min(dataWakeUp, pathMtu.deadline());
+    Message result;
+    if (demux.take(ackFilter, result, wakeUp))
+    {
+      bool progress = processAck(result);
+      // Fold in every ACK that is already queued before refilling the window
+      while (demux.take(ackFilter, result, clock::now()))
       {
-        if (t.joinable())
-        {
-          t.join();
-        }
+        progress = processAck(result) || progress;
+      }
+      if (progress)
+      {
+        timeouts = 0;
       }
-      threads.clear();
-      retry = false;
+      // A probe answered with a zero window keeps backing off
+      probes = 0;
+      if (peerWindow > 0)
+      {
+        persistTimeout = rtt.getRto();
+      }
+      continue;
     }
-  }
-  for (auto &t : threads)
-  {
-    if (t.joinable())
+
+    if (!isListening)
+    {
+      return ConnectionResult(false, destIP, destPort, 0, 0);
+    }
+    if (clock::now() < dataWakeUp)
+    {
+      continue;
+    }
+    if (windowClosed)
+    {
+      // Probe with the first unacknowledged segment, an answer always
+      // carries the current window even if the segment does not fit
+      if (++probes > MAX_RETRANSMITS)
+      {
+        return ConnectionResult(false, destIP, destPort, 0, 0);
+      }
+      uint32_t probeSeqNum = sh->getCurrentAckNum() + 1;
+      // A probe that was never sent enters the window, otherwise the ACK
+      // covering it lies past everything sent and is ignored
+      Segment *probe = sh->getCurrentSeqNum() == sh->getCurrentAckNum()
+                           ? sh->advanceWindow(1)
+                           : sh->segmentAt(probeSeqNum);
+      if (probe == nullptr)
+      {
+        continue;
+      }
+      std::cout << OUT << brackets("WINDOW PROBE")
+                << brackets("Seq " + std::to_string(probeSeqNum - startingSeqNum))
+                << brackets("S=" + std::to_string(probeSeqNum))
+                << brackets("WND=" + std::to_string(peerWindow)) << "Sent"
+                << endl;
+      sendSegment(*probe, destIP, destPort);
+      sendTimes[probeSeqNum].second = true;
+      persistTimeout = std::min(persistTimeout * 2, RTO_MAX);
+      continue;
+    }
+    uint32_t lostSeqNum = timers.front().second;
+    std::cout << OUT << brackets("TIMEOUT")
+              << brackets("Seq " + std::to_string(lostSeqNum - startingSeqNum))
+              << brackets("S=" + std::to_string(lostSeqNum))
+              << brackets("RTO=" + std::to_string(rtt.getRto().count()) + "us")
+              << brackets("CWND=" + std::to_string(sh->getWindowSize()))
+              << "Timeout" << endl;
+    if (++timeouts > MAX_RETRANSMITS)
     {
-      t.join();
+      return ConnectionResult(false, destIP, destPort, 0, 0);
+    }
+    rtt.backoff();
+    congestion.onTimeout(sh->getCurrentSeqNum() - sh->getCurrentAckNum());
+    inRecovery = false;
+    dupAcks = 0;
+    if (connection.arqMode == ArqMode::SELECTIVE_REPEAT)
+    {
+      // Every timer that has expired by now belongs to the same loss event
+      vector<uint32_t> expired;
+      auto now = clock::now();
+      while (!timers.empty() && timers.front().first <= now)
+      {
+        expired.push_back(timers.front().second);
+        timers.pop_front();
+      }
+      for (uint32_t seqNum : expired)
+      {
+        retransmit(seqNum, "TIMEOUT");
+      }
+    }
+    else
+    {
+      sh->goBackWindow();
+      timers.clear();
     }
   }
-  threads.clear();
 
   std::cout << OUT << brackets(status_strings[(int)status])
             << "All segments sent to " << destIP << ":" << destPort << endl;
   return ConnectionResult(true, destIP, destPort, 0, 0);
 }
 
+/**
+ * Collapse buffered out-of-order segments into SACK ranges, the block holding
+ * the segment that just arrived goes first. outOfOrder is keyed by position
+ * relative to baseSeqNum.
+ */
+static vector<SackBlock> buildSackBlocks(const std::map<uint32_t, Message> &outOfOrder,
+                                         uint32_t baseSeqNum,
+                                         uint32_t latestSeqNum)
+{
+  vector<SackBlock> blocks;
+  for (const auto &entry : outOfOrder)
+  {
+    uint32_t entrySeqNum = baseSeqNum + entry.first;
+    if (!blocks.empty() && blocks.back().end == entrySeqNum)
+    {
+      blocks.back().end++;
+    }
+    else
+    {
+      blocks.push_back(SackBlock{entrySeqNum, entrySeqNum + 1});
+    }
+  }
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    if (seqLeq(blocks[i].start, latestSeqNum) &&
+        seqLt(latestSeqNum, blocks[i].end))
+    {
+      std::rotate(blocks.begin(), blocks.begin() + i, blocks.begin() + i + 1);
+      break;
+    }
+  }
+  if (blocks.size() > MAX_SACK_BLOCKS)
+  {
+    blocks.resize(MAX_SACK_BLOCKS);
+  }
+  return blocks;
+}
+
 string TCPSocket::concatenatePayloads(vector<Segment> &segments)
 {
   string concatenatedData;
@@ -319,13 +1090,18 @@ string TCPSocket::concatenatePayloads(vector<Segment> &segments)
   return concatenatedData;
 }
 
-ConnectionResult TCPSocket::receiveBackN(vector<Segment> &resBuffer,
+ConnectionResult TCPSocket::receiveBackN(DataSink &sink, string &fileName,
                                          string destIP, uint16_t destPort,
                                          uint32_t seqNum)
 {
+  // Next offset in the output, payloads are written as soon as they are in order
+  uint64_t written = 0;
   int i = 0;
   int limit = 0;
   uint32_t seqNumIt = seqNum;
+  // Segments that arrived ahead of seqNumIt, keyed by position in the stream
+  // so the order survives a seqNum wrap
+  std::map<uint32_t, Message> outOfOrder;
   std::optional<std::chrono::high_resolution_clock::time_point> start_time;
   while (limit < 10)
   {
@@ -346,49 +1122,110 @@ ConnectionResult TCPSocket::receiveBackN(vector<Segment> &resBuffer,
         }
       }
 
-      if (consumedSucc && res.segment.seqNum < seqNumIt)
+      uint32_t probeId = 0;
+      if (consumedSucc && getPathProbe(res.segment, probeId))
+      {
+        // Path MTU probe, arriving at all is the answer. Echo its tag.
+        Segment probeAck = ack(res.segment.seqNum, seqNumIt);
+        setPathProbe(probeAck, probeId);
+        probeAck.window = encodeWindow(receiveWindow(outOfOrder.size()));
+        updateChecksum(probeAck);
+        sendSegment(probeAck, destIP, destPort);
+        continue;
+      }
+
+      uint32_t segSeqNum = res.segment.seqNum;
+      if (consumedSucc && res.segment.flags.fin != 1 &&
+          res.segment.flags.syn != 1 && seqLt(segSeqNum, seqNumIt))
       {
-        if (res.segment.flags.fin != 1)
+        // Our ACK got lost, repeat the cumulative one
+        Segment ackSegment = ack(segSeqNum, seqNumIt);
+        ackSegment.window = encodeWindow(receiveWindow(outOfOrder.size()));
+        updateChecksum(ackSegment);
+        sendSegment(ackSegment, destIP, destPort);
+        if (start_time.has_value())
         {
-          Segment ackSegment = ack(0, res.segment.seqNum + 1);
-          updateChecksum(ackSegment);
-          sendSegment(ackSegment, destIP, destPort);
           start_time = std::chrono::high_resolution_clock::now();
         }
       }
-      if (res.segment.seqNum == seqNumIt)
+      else if (consumedSucc && res.segment.flags.fin != 1 &&
+               res.segment.flags.syn != 1 &&
+               segSeqNum - seqNumIt < RECEIVE_WINDOW)
       {
-        i++;
-        resBuffer.push_back(res.segment);
-        std::cout << IN << brackets(status_strings[(int)status])
-                  << brackets("Seq " + std::to_string(i))
-                  << brackets("S=" + std::to_string(res.segment.seqNum))
-                  << "ACKed" << endl;
-        seqNumIt++;
-        Segment ackSegment = ack(0, seqNumIt);
+        // A GRO slot holds many datagrams and is only recycled once every
+        // one of them is released, so a segment waiting out a gap takes
+        // its payload along instead of pinning the whole slot
+        if (segSeqNum != seqNumIt &&
+            res.buffer.capacity() > MAX_DATAGRAM_SIZE)
+        {
+          res.ownPayload();
+        }
+        outOfOrder.emplace(segSeqNum - seqNum, std::move(res));
+
+        // Hand over the contiguous run starting at seqNumIt
+        bool endOfStream = false;
+        while (!outOfOrder.empty() &&
+               outOfOrder.begin()->first == seqNumIt - seqNum)
+        {
+          Segment &segment = outOfOrder.begin()->second.segment;
+          i++;
+          if (segment.flags.ece == 1)
+          {
+            // Metadata segment, carries the file name instead of data
+            fileName.assign(reinterpret_cast<char *>(segment.payload),
+                            segment.payloadSize);
+          }
+          else if (segment.payloadSize > 0)
+          {
+            if (!sink.write(written, segment.payload, segment.payloadSize))
+            {
+              commandLine('!', "[ERROR] Failed to write received data");
+              return ConnectionResult(false, destIP, destPort, seqNum, 0);
+            }
+            written += segment.payloadSize;
+          }
+          endOfStream = endOfStream || segment.flags.psh == 1;
+          std::cout << IN << brackets(status_strings[(int)state.status])
+                    << brackets("Seq " + std::to_string(i))
+                    << brackets("S=" + std::to_string(seqNumIt))
+                    << "ACKed" << endl;
+          outOfOrder.erase(outOfOrder.begin());
+          seqNumIt++;
+        }
+
+        // Cumulative ACK, seqNum names the segment that triggered it and the
+        // SACK blocks describe what is held beyond the gap
+        Segment ackSegment = ack(segSeqNum, seqNumIt);
+        setSackBlocks(ackSegment, buildSackBlocks(outOfOrder, seqNum, segSeqNum));
+        ackSegment.window = encodeWindow(receiveWindow(outOfOrder.size()));
         updateChecksum(ackSegment);
         sendSegment(ackSegment, destIP, destPort);
 
-        std::cout << OUT << brackets(status_strings[(int)status])
+        std::cout << OUT << brackets(status_strings[(int)state.status])
                   << brackets("Seq " + std::to_string(i))
                   << brackets("A=" + std::to_string(seqNumIt)) << "Sent"
                   << endl;
 
-        if (res.segment.flags.psh == 1)
+        if (endOfStream && !start_time.has_value())
         {
-          if (!start_time.has_value())
-          {
-            // Start waiting for server's segments that hasnt been acked at server side
-            start_time = std::chrono::high_resolution_clock::now();
-            cout << OUT << " Start waiting for Segments who Server not yet received the ACK and send the corresponding ACK." << endl;
-            continue;
-          }
-          else
-          {
-            return ConnectionResult(true, destIP, destPort, seqNum, 0);
-          }
+          // Start waiting for server's segments that hasnt been acked at server side
+          start_time = std::chrono::high_resolution_clock::now();
+          cout << OUT << " Start waiting for Segments who Server not yet received the ACK and send the corresponding ACK." << endl;
+          continue;
         }
       }
+      else if (consumedSucc && res.segment.flags.fin != 1 &&
+               res.segment.flags.syn != 1)
+      {
+        // Beyond our buffer (a window probe or a sender that overran it):
+        // drop it but tell the sender where the window stands. A pure window
+        // update names the last in-order segment, never the dropped one, so
+        // Selective Repeat does not mark it as received.
+        Segment ackSegment = ack(seqNumIt - 1, seqNumIt);
+        ackSegment.window = encodeWindow(receiveWindow(outOfOrder.size()));
+        updateChecksum(ackSegment);
+        sendSegment(ackSegment, destIP, destPort);
+      }
 
       if (start_time.has_value())
       {
@@ -404,7 +1241,7 @@ ConnectionResult TCPSocket::receiveBackN(vector<Segment> &resBuffer,
     catch (const std::exception &e)
     {
       limit++;
-      commandLine('!', "[ERROR] " + brackets(status_strings[(int)status]) + std::string(e.what()));
+      commandLine('!', "[ERROR] " + brackets(status_strings[(int)state.status]) + std::string(e.what()));
     }
   }
   return ConnectionResult(false, destIP, destPort, seqNum, 0);
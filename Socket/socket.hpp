@@ -2,19 +2,32 @@
 #define SOCKET_HPP
 
 #include "../Message/message.hpp"
+#include "../Segment/data_sink.hpp"
 #include "../Segment/segment.hpp"
 #include "../Segment/segment_handler.hpp"
 #include "../Socket/connection_result.hpp"
+#include "../Socket/packet_demux.hpp"
+#include "../Socket/path_mtu.hpp"
+#include "../Socket/rtt_estimator.hpp"
 #include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <thread>
+#include <unordered_map>
 #include <unistd.h>
 #include <vector>
 #include "../tools/tools.hpp"
@@ -26,6 +39,37 @@ using std::string;
 using std::vector;
 
 constexpr uint32_t DEFAULT_TIMEOUT = 2;
+// Consecutive timeouts before a transfer is abandoned
+constexpr int MAX_RETRANSMITS = 10;
+// Duplicate ACKs that signal a lost segment (fast retransmit)
+constexpr uint32_t DUP_ACK_THRESHOLD = 3;
+// Segments the receiver buffers ahead of the next expected one, about 96 MB
+// of full segments, so it only fits the 16 bit window field when scaled
+constexpr uint32_t RECEIVE_WINDOW = 65536;
+// Whatever the window lets the peer send must fit in the demux while the
+// receiving thread catches up
+static_assert(DEMUX_PENDING_LIMIT >= RECEIVE_WINDOW,
+              "the demux must hold a full receive window per peer");
+// Kernel buffers asked for per socket so a full window survives a burst
+constexpr int SOCKET_BUFFER_SIZE = 32 * 1024 * 1024;
+// Receive slots the listener decodes segments into before falling back to heap
+constexpr uint32_t RECV_POOL_SLOTS = 1024;
+// Datagrams pulled per recvmmsg call by the listener, 1 means plain recvfrom
+constexpr uint32_t RECV_BATCH_SIZE = 32;
+// With UDP GRO one receive holds up to a full UDP datagram worth of segments,
+// so slots are that large and fewer of them are kept
+constexpr uint32_t GRO_BUFFER_SIZE = 65535;
+constexpr uint32_t GRO_POOL_SLOTS = 256;
+// Most datagrams one UDP_SEGMENT send is split into, and its byte limit
+constexpr uint32_t GSO_MAX_SEGMENTS = 64;
+constexpr uint32_t GSO_MAX_BYTES = 65507;
+
+// Room for the one control message carrying a GSO or GRO segment size
+union OffloadControl
+{
+  char data[CMSG_SPACE(sizeof(int))];
+  cmsghdr align;
+};
 
 enum class TCPStatusEnum
 {
@@ -42,33 +86,143 @@ enum class TCPStatusEnum
   CLOSED
 };
 
+enum class ArqMode
+{
+  GO_BACK_N,
+  SELECTIVE_REPEAT
+};
+
 const std::vector<std::string> status_strings = {
     "LISTENING", "SYN_SENT", "SYN_RECEIVED", "ESTABLISHED", "FIN_WAIT_1",
     "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING", "LAST_ACK", "TIME_WAIT", "CLOSED"};
 
+/**
+ * Everything one connection keeps about its peer. A TCPSocket has one for
+ * the connection it serves itself; a server handling several clients on the
+ * same socket keeps one per peer and passes it to sendBackN.
+ */
+class ConnectionState
+{
+public:
+  TCPStatusEnum status;
+  ArqMode arqMode;
+  CongestionAlgorithm congestionAlgorithm;
+  RttEstimator rtt;
+  // Free receive buffer the peer advertised in its last ACK, in segments
+  uint32_t peerWindow;
+  // Window scale shifts, both stay 0 unless the handshake negotiated them
+  uint8_t sendWindowShift;
+  uint8_t receiveWindowShift;
+  // Largest payload both ends accept, the ceiling for path MTU discovery
+  uint32_t maxPayload;
+  // Part of the content this connection carries, only set when the
+  // transfer is split over several streams (count > 1)
+  StreamRange stream;
+  SegmentHandler handler;
+
+  ConnectionState();
+  ConnectionState(const ConnectionState &) = delete;
+  ConnectionState &operator=(const ConnectionState &) = delete;
+
+  // Take over the ARQ mode and congestion control chosen for defaults
+  void configureLike(const ConnectionState &defaults);
+  void setCongestionControl(CongestionAlgorithm algo);
+
+  // Window scaling (RFC 7323): offer ours on SYN/SYN-ACK, then adopt the
+  // peer's shift if it offered one as well
+  static void offerWindowScale(Segment &segment);
+  void acceptWindowScale(const Segment &peerSegment);
+  uint16_t encodeWindow(uint32_t window) const;
+  uint32_t decodeWindow(uint16_t window) const;
+
+  // MSS: settle on the smaller of our limit and what the peer announced
+  void acceptMaxSegmentSize(const Segment &peerSegment, uint32_t localMax);
+};
+
 class TCPSocket
 {
 private:
   string ip;
   int32_t port;
   int32_t sockfd;
-  vector<Message> packetBuffer;
-  mutex bufferMutex;
-  condition_variable bufferCondition;
-  TCPStatusEnum status;
-  bool isListening;
+  std::unique_ptr<RecvBufferPool> recvPool;
+  // Largest payload this socket receives, announced as our MSS
+  uint32_t maxPayload;
+  // Search the path MTU by probing, see setPathMtuProbing()
+  bool pathMtuProbing;
+  // Kernel UDP offload, see setOffload(). segmentOffload is guarded by
+  // sendMutex, receiveOffload only changes before listening
+  bool segmentOffload;
+  bool receiveOffload;
+  PacketDemux demux;
+  // State of the connection this socket serves itself
+  ConnectionState state;
+  std::atomic<bool> isListening;
   std::thread listenerThread;
-  SegmentHandler *sh;
+
+  // Listener side state for batched receive, only touched by produceBuffer
+  uint32_t receiveBatchSize;
+  vector<RecvBufferRef> recvBuffers;
+  vector<mmsghdr> recvHeaders;
+  vector<iovec> recvIovecs;
+  vector<sockaddr_in> recvAddresses;
+  vector<OffloadControl> recvControls;
+  vector<Message> recvReady;
+
+  // Reusable header area and iovecs for sendSegments, guarded by sendMutex
+  mutex sendMutex;
+  vector<std::array<uint8_t, MAX_HEADER_SIZE>> sendHeaders;
+  vector<iovec> sendIovecs;
+  vector<mmsghdr> sendMsgs;
+  vector<OffloadControl> sendControls;
+  string cachedDestIP;
+  uint16_t cachedDestPort;
+  sockaddr_in cachedDestAddress;
 
   sockaddr_in createSockAddr(const string &ipAddress, int port);
+  sockaddr_in resolveDestination(const string &destinationIP,
+                                 uint16_t destinationPort);
+  // Replace the receive pool with slots sized for maxPayload or GRO
+  void resizeRecvPool();
+  // Fill sendMsgs from segments[first..], equal sized runs share one message
+  // when segmentOffload is on. Returns the number of messages.
+  size_t packSendMessages(const vector<const Segment *> &segments,
+                          size_t first, sockaddr_in &destAddress);
+  void receiveSingle();
+  void receiveBatch();
+  // Window to advertise while holding this many out-of-order segments
+  uint32_t receiveWindow(size_t held);
 
 public:
   explicit TCPSocket(const string &ip, int port);
   ~TCPSocket();
   void bindSocket();
   void setBroadcast();
+  // Accept payloads up to size bytes, clamped to the supported range. Must be
+  // called before startListening(), receive slots are sized for it.
+  void setMaxPayload(uint32_t size);
+  uint32_t getMaxPayload() const { return maxPayload; }
+  // Set DF on sends and search the largest payload the path delivers, from
+  // the RFC 8899 base size up to the negotiated one. Off by default, sends
+  // then use the negotiated size right away. Must be called before
+  // startListening().
+  void setPathMtuProbing(bool enable);
+  bool getPathMtuProbing() const { return pathMtuProbing; }
+  // Send runs of equal sized segments as one UDP_SEGMENT super-buffer and
+  // take coalesced UDP_GRO receives. Must be called before startListening().
+  // Returns false if the kernel lacks either, the missing side stays off.
+  bool setOffload(bool enable);
+  bool getOffload() const { return segmentOffload || receiveOffload; }
+  // Let several sockets bind the same port, the kernel spreads flows across
+  // them by address hash. Must be called before listen().
+  void setReusePort();
+  // Pick the socket of a SO_REUSEPORT group by peer port modulo groupSize,
+  // in bind order, instead of the kernel's hash. Returns false if the kernel
+  // refuses the filter.
+  bool steerByPeerPort(uint32_t groupSize);
   void listen();
 
+  void setReceiveBatch(uint32_t batchSize);
   void startListening();
   void stopListening();
 
@@ -76,19 +230,49 @@ public:
             uint32_t size);
   void sendSegment(const Segment &segment, const string &destinationIP,
                    uint16_t destinationPort);
+  void sendSegments(const vector<const Segment *> &segments,
+                    const string &destinationIP, uint16_t destinationPort);
 
   int32_t receive(void *buffer, uint32_t bufferSize, bool peek = false);
 
   void produceBuffer();
+  Message consumeBuffer(const DemuxFilter &filter, int timeout = 10);
   Message consumeBuffer(const string &filterIP = "", uint16_t filterPort = 0,
                         uint32_t filterSeqNum = 0, uint32_t filterAckNum = 0,
                         uint8_t filterFlags = 0, int timeout = 10);
 
-  ConnectionResult sendBackN(uint8_t *dataStream, uint32_t dataSize,
+  ConnectionResult sendBackN(uint8_t *dataStream, uint64_t dataSize,
                  const string &destIP, uint16_t destPort, uint32_t startingSeqNum, bool isFile, string fileFullName);
+  // Segments are cut from source as the window advances
+  ConnectionResult sendBackN(DataSource &source, const string &destIP,
+                             uint16_t destPort, uint32_t startingSeqNum,
+                             bool isFile, string fileFullName);
+  // Same, for one of several connections sharing this socket
+  ConnectionResult sendBackN(ConnectionState &connection, DataSource &source,
+                             const string &destIP, uint16_t destPort,
+                             uint32_t startingSeqNum, bool isFile,
+                             string fileFullName);
   string concatenatePayloads(vector<Segment> &segments);
-  ConnectionResult receiveBackN(vector<Segment> &resBuffer, string dest_ip, uint16_t dest_port, uint32_t seqNum);
+  // Payloads go to sink in order, the metadata segment fills fileName
+  ConnectionResult receiveBackN(DataSink &sink, string &fileName, string dest_ip, uint16_t dest_port, uint32_t seqNum);
+
+  void setArqMode(ArqMode mode);
+  void addRttSample(microseconds sample);
+  void setCongestionControl(CongestionAlgorithm algo);
+  void setPeerWindow(uint32_t window);
+  ConnectionState &getState() { return state; }
+
+  // Packets from a claimed peer only reach consumers filtering on that
+  // peer, so wildcard waits (broadcast, accept) never take them
+  void claimPeer(const string &peerIP, uint16_t peerPort);
+  void releasePeer(const string &peerIP, uint16_t peerPort);
 
+  void offerWindowScale(Segment &segment);
+  void acceptWindowScale(const Segment &peerSegment);
+  uint16_t encodeWindow(uint32_t window) const;
+  uint32_t decodeWindow(uint16_t window) const;
+  void offerMaxSegmentSize(Segment &segment) const;
+  void acceptMaxSegmentSize(const Segment &peerSegment);
   void setStatus(TCPStatusEnum newState);
   TCPStatusEnum getStatus() const;
   void close();
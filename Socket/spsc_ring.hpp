@@ -0,0 +1,92 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * Bounded lock-free ring for one producer thread and one consumer at a time.
+ *
+ * head and tail live on their own cache lines and each side keeps a cached
+ * copy of the other's index, so a push or pop touches shared state only when
+ * the ring looks full or empty. Indices run freely and wrap, the capacity is
+ * a power of two.
+ */
+template <typename T>
+class SpscRing
+{
+private:
+  std::vector<T> slots;
+  uint32_t mask;
+
+  alignas(64) std::atomic<uint32_t> head; // next slot to pop, consumer owned
+  uint32_t cachedTail;
+  alignas(64) std::atomic<uint32_t> tail; // next slot to fill, producer owned
+  uint32_t cachedHead;
+
+  static uint32_t roundUp(uint32_t capacity)
+  {
+    uint32_t size = 1;
+    while (size < capacity)
+    {
+      size <<= 1;
+    }
+    return size;
+  }
+
+public:
+  explicit SpscRing(uint32_t capacity)
+      : slots(roundUp(capacity)), mask(roundUp(capacity) - 1), head(0),
+        cachedTail(0), tail(0), cachedHead(0) {}
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  // Producer only. value is left untouched when the ring is full
+  bool push(T &&value)
+  {
+    uint32_t at = tail.load(std::memory_order_relaxed);
+    if (at - cachedHead > mask)
+    {
+      cachedHead = head.load(std::memory_order_acquire);
+      if (at - cachedHead > mask)
+      {
+        return false;
+      }
+    }
+    slots[at & mask] = std::move(value);
+    tail.store(at + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only
+  bool pop(T &value)
+  {
+    uint32_t at = head.load(std::memory_order_relaxed);
+    if (at == cachedTail)
+    {
+      cachedTail = tail.load(std::memory_order_acquire);
+      if (at == cachedTail)
+      {
+        return false;
+      }
+    }
+    value = std::move(slots[at & mask]);
+    head.store(at + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate when called while the other side is running
+  uint32_t size() const
+  {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+
+  bool full() const { return size() > mask; }
+  uint32_t capacity() const { return mask + 1; }
+};
+
+#endif
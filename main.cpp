@@ -8,7 +8,9 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <string>
+#include <vector>
 
 std::string transformFilePath(const std::string &filePath)
 {
@@ -39,24 +41,42 @@ int main(int argc, char *argv[])
   std::string ip = "localhost";
   int port = 8080; // Default port
 
+  // Options look like --key=value, everything else is [ip] [port]
+  std::vector<std::string> positional;
+  std::map<std::string, std::string> options;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) == 0)
+    {
+      size_t eq = arg.find('=');
+      std::string key = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+      options[key] = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    }
+    else
+    {
+      positional.push_back(arg);
+    }
+  }
+
   // Process arguments
-  if (argc > 1)
+  if (positional.size() > 0)
   { // Check if at least one argument is provided
-    if (isNumber(argv[1]))
+    if (isNumber(positional[0]))
     { // If the first argument is a port
-      port = std::stoi(argv[1]);
+      port = std::stoi(positional[0]);
     }
     else
     { // Otherwise, it's an IP
-      ip = argv[1];
+      ip = positional[0];
     }
   }
 
-  if (argc > 2)
+  if (positional.size() > 1)
   { // Check if the second argument (port) is provided
-    if (isNumber(argv[2]))
+    if (isNumber(positional[1]))
     {
-      port = std::stoi(argv[2]);
+      port = std::stoi(positional[1]);
     }
     else
     {
@@ -65,6 +85,68 @@ int main(int argc, char *argv[])
   }
 
   Server server(ip, port);
+  if (options.count("arq"))
+  {
+    if (options["arq"] == "sr")
+    {
+      server.setArqMode(ArqMode::SELECTIVE_REPEAT);
+    }
+    else if (options["arq"] != "gbn")
+    {
+      std::cerr << "Unknown ARQ mode " << options["arq"] << ". Using gbn\n";
+    }
+  }
+  if (options.count("workers"))
+  {
+    if (isNumber(options["workers"]) && std::stoi(options["workers"]) > 0)
+    {
+      server.setWorkers(std::stoi(options["workers"]));
+    }
+    else
+    {
+      std::cerr << "Invalid worker count " << options["workers"]
+                << ". Using 1\n";
+    }
+  }
+  CongestionAlgorithm congestion;
+  if (options.count("cc"))
+  {
+    if (parseCongestionAlgorithm(options["cc"], congestion))
+    {
+      server.setCongestionControl(congestion);
+    }
+    else
+    {
+      std::cerr << "Unknown congestion control " << options["cc"]
+                << ". Using newreno\n";
+    }
+  }
+  // Largest payload this node accepts. Giving an MTU also turns on path MTU
+  // probing, which searches below it.
+  uint32_t maxPayload = MAX_PAYLOAD_SIZE;
+  bool pathMtuProbing = false;
+  if (options.count("mtu"))
+  {
+    if (isNumber(options["mtu"]) && std::stoi(options["mtu"]) >= 1200 &&
+        std::stoi(options["mtu"]) <= 9000)
+    {
+      maxPayload = payloadForMtu(std::stoi(options["mtu"]));
+      pathMtuProbing = true;
+      server.setMaxPayload(maxPayload);
+      server.setPathMtuProbing(true);
+    }
+    else
+    {
+      std::cerr << "Invalid MTU " << options["mtu"]
+                << ". Path MTU probing stays off\n";
+    }
+  }
+  // Kernel UDP segmentation and receive coalescing, Linux 5.0 and later
+  bool offload = options.count("offload") > 0;
+  if (offload && !server.setOffload(true))
+  {
+    std::cerr << "UDP GSO/GRO is not fully supported by this kernel\n";
+  }
 
   commandLine('i', "Node started at " + ip + ":" + std::to_string(port));
   commandLine('?', "Please chose the operating mode");
@@ -109,9 +191,8 @@ int main(int argc, char *argv[])
 
       if (std::filesystem::exists(transformedFilePath))
       {
-        commandLine('+', "File has been successfully read.");
-        convertToFileContentAndSetItem(
-            transformedFilePath, server);
+        commandLine('+', "File found, it is read while sending.");
+        server.setFilePath(transformedFilePath);
         std::filesystem::path filePathObj(transformedFilePath);
         std::string fileName = filePathObj.stem().string();
         std::string fileExtension = filePathObj.extension().string();
@@ -148,6 +229,22 @@ int main(int argc, char *argv[])
                          std::to_string(serverPort));
 
     Client client(ip, port, serverPort);
+    client.setMaxPayload(maxPayload);
+    client.setPathMtuProbing(pathMtuProbing);
+    client.setOffload(offload);
+    if (options.count("streams"))
+    {
+      if (isNumber(options["streams"]) && std::stoi(options["streams"]) > 0 &&
+          std::stoi(options["streams"]) <= MAX_STREAMS)
+      {
+        client.setStreams(std::stoi(options["streams"]));
+      }
+      else
+      {
+        std::cerr << "Invalid stream count " << options["streams"]
+                  << ". Using 1\n";
+      }
+    }
     client.run();
   }
   else
@@ -0,0 +1,36 @@
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+#include <atomic>
+#include <cstdio>
+
+// Failed CHECKs so far, atomic because some tests check from several threads
+inline std::atomic<int> checkFailures(0);
+
+#define CHECK(condition)                                                  \
+  do                                                                      \
+  {                                                                       \
+    if (!(condition))                                                     \
+    {                                                                     \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,        \
+                  #condition);                                            \
+      checkFailures++;                                                    \
+    }                                                                     \
+  } while (0)
+
+/**
+ * Report how the checks of the test program called name went, the result
+ * is its exit code
+ */
+inline int checkResult(const char *name)
+{
+  if (checkFailures > 0)
+  {
+    std::printf("%s: %d checks failed\n", name, checkFailures.load());
+    return 1;
+  }
+  std::printf("%s: all checks passed\n", name);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "../Segment/checksum.hpp"
+#include "check.hpp"
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const char *KERNELS[] = {"scalar", "sse2", "avx2"};
+
+// RFC 1071 one word at a time, independent of every kernel
+static uint64_t referenceSum(uint64_t sum, const uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i + 1 < length; i += 2)
+  {
+    sum += (uint16_t)((data[i] << 8) | data[i + 1]);
+  }
+  if (length & 1)
+  {
+    sum += (uint16_t)(data[length - 1] << 8);
+  }
+  return sum;
+}
+
+// Every kernel folds to the same checksum as the reference, for random
+// lengths (odd ones included) starting at every alignment
+static void testKernelsAgree()
+{
+  std::mt19937 random(1071);
+  std::vector<uint8_t> buffer(70000 + 64);
+  for (uint8_t &byte : buffer)
+  {
+    byte = (uint8_t)random();
+  }
+
+  for (const char *name : KERNELS)
+  {
+    if (!checksumUseKernel(name))
+    {
+      std::printf("checksum_test: no %s kernel here, skipped\n", name);
+      continue;
+    }
+    for (int round = 0; round < 2000; round++)
+    {
+      size_t offset = random() % 64;
+      size_t length = round < 200 ? round : random() % 70000;
+      uint64_t start = round % 3 == 0 ? 0 : random();
+      const uint8_t *data = buffer.data() + offset;
+      uint16_t expected = checksumFold(referenceSum(start, data, length));
+      uint16_t got = checksumFold(checksumAdd(start, data, length));
+      if (got != expected)
+      {
+        std::printf("%s: length %zu at offset %zu\n", name, length, offset);
+        CHECK(got == expected);
+        break;
+      }
+    }
+  }
+}
+
+// Long runs of 0xFF push every lane accumulator to its limit before the
+// kernels widen it
+static void testLongSaturatedInput()
+{
+  std::vector<uint8_t> buffer(3 * 1024 * 1024 + 7, 0xFF);
+  uint16_t expected =
+      checksumFold(referenceSum(0, buffer.data(), buffer.size()));
+  for (const char *name : KERNELS)
+  {
+    if (checksumUseKernel(name))
+    {
+      CHECK(checksumFold(checksumAdd(0, buffer.data(), buffer.size())) ==
+            expected);
+    }
+  }
+}
+
+// checksumCopy leaves dst as memcpy would, touching nothing past it, and
+// sums what checksumAdd sums
+static void testCopyMatchesMemcpy()
+{
+  std::mt19937 random(793);
+  std::vector<uint8_t> source(20000 + 64);
+  for (uint8_t &byte : source)
+  {
+    byte = (uint8_t)random();
+  }
+
+  for (const char *name : KERNELS)
+  {
+    if (!checksumUseKernel(name))
+    {
+      continue;
+    }
+    for (int round = 0; round < 1000; round++)
+    {
+      size_t srcOffset = random() % 64;
+      size_t dstOffset = random() % 64;
+      size_t length = round < 100 ? round : random() % 20000;
+      uint64_t start = random();
+      std::vector<uint8_t> copied(length + 128, 0xA5);
+      std::vector<uint8_t> expected(length + 128, 0xA5);
+      const uint8_t *src = source.data() + srcOffset;
+      memcpy(expected.data() + dstOffset, src, length);
+
+      uint64_t sum =
+          checksumCopy(start, copied.data() + dstOffset, src, length);
+      bool same = copied == expected &&
+                  checksumFold(sum) ==
+                      checksumFold(checksumAdd(start, src, length));
+      if (!same)
+      {
+        std::printf("%s: length %zu from %zu to %zu\n", name, length,
+                    srcOffset, dstOffset);
+        CHECK(same);
+        break;
+      }
+    }
+  }
+}
+
+int main()
+{
+  testKernelsAgree();
+  testLongSaturatedInput();
+  testCopyMatchesMemcpy();
+  return checkResult("checksum_test");
+}
@@ -0,0 +1,132 @@
+#include "../Segment/congestion_control.hpp"
+#include "check.hpp"
+#include <cmath>
+
+using std::chrono::microseconds;
+
+static const microseconds RTT(10000);
+
+// Slow start adds a segment per ACKed segment, congestion avoidance about
+// one per window, and both kinds of loss halve ssthresh (RFC 5681, 6582)
+static void testNewReno()
+{
+  NewReno reno;
+  CHECK(reno.getWindow() == INITIAL_CONGESTION_WINDOW);
+  CHECK(reno.inSlowStart());
+  reno.onAck(5, RTT);
+  CHECK(reno.getWindow() == 15);
+
+  reno.onLoss(20);
+  CHECK(reno.getSlowStartThreshold() == 10);
+  CHECK(reno.getWindow() == 10);
+  CHECK(!reno.inSlowStart());
+  reno.onAck(10, RTT);
+  CHECK(reno.getWindow() == 11);
+
+  // Slow start again up to the new ssthresh, the rest counts as avoidance
+  reno.onTimeout(30);
+  CHECK(reno.getSlowStartThreshold() == 15);
+  CHECK(reno.getWindow() == 1);
+  reno.onAck(20, RTT);
+  CHECK(reno.getWindow() == 15);
+
+  // ssthresh never drops below MIN_SLOW_START_THRESHOLD
+  reno.onLoss(1);
+  CHECK(reno.getSlowStartThreshold() == MIN_SLOW_START_THRESHOLD);
+  CHECK(reno.getWindow() == MIN_SLOW_START_THRESHOLD);
+}
+
+// The window is capped however long the run without loss
+static void testWindowCap()
+{
+  NewReno reno;
+  for (int i = 0; i < 30; i++)
+  {
+    reno.onAck(MAX_CONGESTION_WINDOW, RTT);
+  }
+  CHECK(reno.getWindow() == MAX_CONGESTION_WINDOW);
+}
+
+// Grown to 100 segments by slow start
+static void growTo100(Cubic &cubic)
+{
+  cubic.onAck(100 - INITIAL_CONGESTION_WINDOW, RTT);
+  CHECK(cubic.getWindow() == 100);
+}
+
+// A loss cuts the window to beta = 0.7 of it, and the cubic curve climbs
+// back to the old maximum K seconds after the loss (RFC 8312)
+static void testCubicRecovery()
+{
+  Cubic cubic;
+  growTo100(cubic);
+  cubic.onLoss(100);
+  CHECK(cubic.getSlowStartThreshold() == 70);
+  CHECK(cubic.getWindow() == 70);
+
+  // The first ACK starts the epoch. An RTT of K puts the target one RTT
+  // ahead right at the old maximum.
+  double k = std::cbrt((100 - 70) / 0.4);
+  cubic.onAck(70, microseconds((long long)(k * 1000000)));
+  CHECK(cubic.getWindow() >= 98);
+  CHECK(cubic.getWindow() <= 100);
+}
+
+// Right after a loss the cubic target sits at the reduced window, so only
+// the TCP-friendly estimate makes the window grow, about as fast as Reno
+static void testCubicFriendly()
+{
+  Cubic cubic;
+  growTo100(cubic);
+  cubic.onLoss(100);
+  for (int i = 0; i < 10; i++)
+  {
+    cubic.onAck(70, microseconds(0));
+  }
+  CHECK(cubic.getWindow() >= 74);
+  CHECK(cubic.getWindow() <= 76);
+}
+
+// A loss below the previous maximum lowers it further (fast convergence),
+// a timeout restarts from one segment
+static void testCubicReductions()
+{
+  Cubic cubic;
+  growTo100(cubic);
+  cubic.onLoss(100);
+  cubic.onLoss(70);
+  CHECK(cubic.getWindow() == 49);
+  cubic.onTimeout(49);
+  CHECK(cubic.getWindow() == 1);
+  CHECK(cubic.getSlowStartThreshold() == 34);
+  CHECK(cubic.inSlowStart());
+
+  Cubic floor;
+  for (int i = 0; i < 10; i++)
+  {
+    floor.onLoss(1);
+  }
+  CHECK(floor.getSlowStartThreshold() == MIN_SLOW_START_THRESHOLD);
+}
+
+static void testFactory()
+{
+  CongestionAlgorithm algo = CongestionAlgorithm::CUBIC;
+  CHECK(parseCongestionAlgorithm("reno", algo) &&
+        algo == CongestionAlgorithm::NEW_RENO);
+  CHECK(parseCongestionAlgorithm("cubic", algo) &&
+        algo == CongestionAlgorithm::CUBIC);
+  CHECK(!parseCongestionAlgorithm("bbr", algo));
+  CHECK(std::string(makeCongestionControl(algo)->name()) == "cubic");
+}
+
+int main()
+{
+  testNewReno();
+  testWindowCap();
+  testCubicRecovery();
+  testCubicFriendly();
+  testCubicReductions();
+  testFactory();
+  return checkResult("congestion_control_test");
+}
@@ -0,0 +1,228 @@
+#include "../Socket/packet_demux.hpp"
+#include "../Socket/spsc_ring.hpp"
+#include "check.hpp"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+static Message packet(const string &ip, uint16_t port, uint32_t seqNum)
+{
+  Segment segment;
+  segment.seqNum = seqNum;
+  segment.flags.ack = 1;
+  return Message(ip, port, std::move(segment));
+}
+
+// Values come out in the order they went in, across wrap-around, with the
+// producer yielding whenever the ring is full
+static void testRingOrder()
+{
+  const uint32_t count = 200000;
+  SpscRing<uint32_t> ring(64);
+  std::thread producer([&ring]()
+  {
+    for (uint32_t i = 1; i <= count; i++)
+    {
+      uint32_t value = i;
+      while (!ring.push(std::move(value)))
+      {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  uint32_t expected = 1;
+  while (expected <= count)
+  {
+    uint32_t value = 0;
+    if (!ring.pop(value))
+    {
+      continue;
+    }
+    if (value != expected)
+    {
+      CHECK(value == expected);
+      break;
+    }
+    expected++;
+  }
+  producer.join();
+  CHECK(ring.size() == 0);
+}
+
+// take() gives up at its deadline, neither early nor much later
+static void testTakeDeadline()
+{
+  PacketDemux demux;
+  Message out;
+  auto start = steady_clock::now();
+  CHECK(!demux.take(DemuxFilter{"10.0.0.1", 1, 0, 0, 0}, out,
+                    start + milliseconds(50)));
+  auto waited = steady_clock::now() - start;
+  CHECK(waited >= milliseconds(50));
+  CHECK(waited < milliseconds(1000));
+
+  // A deadline in the past still returns what is already there
+  demux.deliver(packet("10.0.0.1", 1, 7));
+  CHECK(demux.take(DemuxFilter{"10.0.0.1", 1, 0, 0, 0}, out,
+                   steady_clock::now() - milliseconds(1)));
+  CHECK(out.segment.seqNum == 7);
+}
+
+// One listener feeding two consumers, each serving its own claimed peer
+// with a short deadline, the way server sessions do. The senders stay
+// within a window of what was taken, as flow control keeps real peers.
+// Every packet arrives once and in order, far more of them than the ring
+// holds.
+static void testStress()
+{
+  const uint32_t perPeer = 100000;
+  const uint32_t window = DEMUX_PENDING_LIMIT / 2;
+  PacketDemux demux;
+  demux.claim("10.0.0.1", 1);
+  demux.claim("10.0.0.2", 2);
+  std::atomic<bool> producing(true);
+  std::atomic<uint32_t> taken[2] = {{0}, {0}};
+
+  std::thread listener([&]()
+  {
+    std::vector<Message> batch;
+    for (uint32_t i = 1; i <= perPeer; i++)
+    {
+      while (i - std::min(taken[0].load(), taken[1].load()) > window)
+      {
+        std::this_thread::yield();
+      }
+      batch.push_back(packet("10.0.0.1", 1, i));
+      batch.push_back(packet("10.0.0.2", 2, i));
+      if (batch.size() == 32 || i == perPeer)
+      {
+        demux.deliver(batch);
+        batch.clear();
+      }
+    }
+    producing = false;
+  });
+
+  auto consume = [&](const string &ip, uint16_t port)
+  {
+    DemuxFilter filter{ip, port, 0, 0, 0};
+    uint32_t expected = 1;
+    int timeouts = 0;
+    while (expected <= perPeer && timeouts < 100)
+    {
+      Message out;
+      if (!demux.take(filter, out, steady_clock::now() + milliseconds(20)))
+      {
+        timeouts += producing ? 0 : 1;
+        continue;
+      }
+      if (out.segment.seqNum != expected || out.ip != ip)
+      {
+        CHECK(out.segment.seqNum == expected);
+        return;
+      }
+      taken[port - 1] = expected++;
+    }
+    CHECK(expected == perPeer + 1);
+  };
+
+  std::thread first(consume, "10.0.0.1", 1);
+  std::thread second(consume, "10.0.0.2", 2);
+  listener.join();
+  first.join();
+  second.join();
+  CHECK(demux.pending() == 0);
+}
+
+// A claimed peer whose reader never comes back fills its backlog and loses
+// its newest packets, while a second claimed peer on the same socket keeps
+// getting every one of its own
+static void testFullBacklogIsolated()
+{
+  const uint32_t stalled = DEMUX_PENDING_LIMIT + DEMUX_RING_CAPACITY * 2;
+  const uint32_t served = stalled / 8;
+  PacketDemux demux;
+  demux.claim("10.0.0.1", 1);
+  demux.claim("10.0.0.2", 2);
+
+  std::thread listener([&]()
+  {
+    for (uint32_t i = 1; i <= stalled; i++)
+    {
+      demux.deliver(packet("10.0.0.1", 1, i));
+      if (i % 8 == 0)
+      {
+        demux.deliver(packet("10.0.0.2", 2, i / 8));
+      }
+    }
+  });
+
+  Message out;
+  DemuxFilter filter{"10.0.0.2", 2, 0, 0, 0};
+  uint32_t expected = 1;
+  while (expected <= served &&
+         demux.take(filter, out, steady_clock::now() + milliseconds(1000)))
+  {
+    if (out.segment.seqNum != expected)
+    {
+      CHECK(out.segment.seqNum == expected);
+      break;
+    }
+    expected++;
+  }
+  listener.join();
+  CHECK(expected == served + 1);
+
+  demux.take(DemuxFilter{"10.0.0.9", 9, 0, 0, 0}, out, steady_clock::now());
+  CHECK(demux.pending() == DEMUX_PENDING_LIMIT);
+  CHECK(demux.take(DemuxFilter{"10.0.0.1", 1, 0, 0, 0}, out,
+                   steady_clock::now()));
+  CHECK(out.segment.seqNum == 1);
+}
+
+// Nobody serves an unclaimed peer, so once its backlog is full the newest
+// packets are dropped and the oldest kept
+static void testUnclaimedDropsNewest()
+{
+  const uint32_t extra = 100;
+  PacketDemux demux;
+  std::atomic<bool> done(false);
+
+  std::thread listener([&]()
+  {
+    for (uint32_t i = 1; i <= DEMUX_PENDING_LIMIT + extra; i++)
+    {
+      demux.deliver(packet("10.0.0.1", 1, i));
+    }
+    done = true;
+  });
+  // Another peer's reader keeps draining the ring
+  Message out;
+  while (!done)
+  {
+    demux.take(DemuxFilter{"10.0.0.9", 9, 0, 0, 0}, out,
+               steady_clock::now() + milliseconds(1));
+  }
+  listener.join();
+  demux.take(DemuxFilter{"10.0.0.9", 9, 0, 0, 0}, out, steady_clock::now());
+  CHECK(demux.pending() == DEMUX_PENDING_LIMIT);
+
+  DemuxFilter filter{"10.0.0.1", 1, 0, 0, 0};
+  CHECK(demux.take(filter, out, steady_clock::now()));
+  CHECK(out.segment.seqNum == 1);
+}
+
+int main()
+{
+  testRingOrder();
+  testTakeDeadline();
+  testStress();
+  testFullBacklogIsolated();
+  testUnclaimedDropsNewest();
+  return checkResult("packet_demux_test");
+}
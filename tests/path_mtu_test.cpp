@@ -0,0 +1,123 @@
+#include "../Socket/path_mtu.hpp"
+#include "check.hpp"
+
+using clock_type = PathMtuSearch::clock;
+
+static const std::chrono::microseconds TIMEOUT(200000);
+
+// A path that carries the largest size confirms it with one probe
+static void testFullSizeFirst()
+{
+  PathMtuSearch search(1148, 8948);
+  CHECK(search.confirmed() == 1148);
+  CHECK(!search.done());
+
+  auto now = clock_type::now();
+  uint32_t id = 0;
+  CHECK(search.nextProbe(now, TIMEOUT, id) == 8948);
+  CHECK(search.deadline() == now + TIMEOUT);
+  // Nothing more while the probe is out
+  uint32_t other = 0;
+  CHECK(search.nextProbe(now, TIMEOUT, other) == 0);
+
+  CHECK(search.onProbeAck(id));
+  CHECK(search.confirmed() == 8948);
+  CHECK(search.done());
+  CHECK(search.nextProbe(now, TIMEOUT, id) == 0);
+  CHECK(search.deadline() == clock_type::time_point::max());
+}
+
+// A probe only counts as lost once its deadline has passed, and the bound
+// only drops after PMTU_MAX_PROBES of them
+static void testExpiryLowersBound()
+{
+  PathMtuSearch search(1148, 8948);
+  auto now = clock_type::now();
+  uint32_t id = 0;
+  for (uint32_t attempt = 1; attempt <= PMTU_MAX_PROBES; attempt++)
+  {
+    CHECK(search.nextProbe(now, TIMEOUT, id) == 8948);
+    search.expire(now + TIMEOUT / 2);
+    uint32_t other = 0;
+    CHECK(search.nextProbe(now, TIMEOUT, other) == 0);
+    now += TIMEOUT;
+    search.expire(now);
+  }
+
+  // Halfway between the confirmed size and just below the lost candidate
+  uint32_t next = search.nextProbe(now, TIMEOUT, id);
+  CHECK(next == 1148 + (8947 - 1148 + 1) / 2);
+  CHECK(search.confirmed() == 1148);
+  CHECK(search.onProbeAck(id));
+  CHECK(search.confirmed() == next);
+}
+
+// A late answer to an earlier attempt of the same candidate still confirms
+// it, answers to anything else are ignored
+static void testProbeIds()
+{
+  PathMtuSearch search(1148, 8948);
+  auto now = clock_type::now();
+  uint32_t first = 0;
+  CHECK(search.nextProbe(now, TIMEOUT, first) == 8948);
+  now += TIMEOUT;
+  search.expire(now);
+  uint32_t second = 0;
+  CHECK(search.nextProbe(now, TIMEOUT, second) == 8948);
+  CHECK(second != first);
+
+  CHECK(!search.onProbeAck(second + 1));
+  CHECK(search.confirmed() == 1148);
+  CHECK(search.onProbeAck(first));
+  CHECK(search.confirmed() == 8948);
+  // The same answer arriving twice changes nothing
+  CHECK(!search.onProbeAck(second));
+}
+
+// Against a path that drops everything above limit, the search ends within
+// PMTU_SEARCH_GRANULARITY of it and never confirms a size that does not fit
+static void testConverges(uint32_t limit)
+{
+  PathMtuSearch search(1148, 8948);
+  auto now = clock_type::now();
+  int probes = 0;
+  while (!search.done() && probes < 100)
+  {
+    uint32_t id = 0;
+    uint32_t size = search.nextProbe(now, TIMEOUT, id);
+    CHECK(size > 0);
+    probes++;
+    if (size <= limit)
+    {
+      search.onProbeAck(id);
+    }
+    now += TIMEOUT;
+    search.expire(now);
+  }
+  CHECK(search.done());
+  CHECK(search.confirmed() <= limit);
+  CHECK(search.confirmed() + PMTU_SEARCH_GRANULARITY > limit);
+}
+
+// A ceiling below the base size is taken as it is, there is nothing to probe
+static void testCeilingBelowBase()
+{
+  PathMtuSearch search(1148, 1000);
+  CHECK(search.confirmed() == 1000);
+  CHECK(search.done());
+  uint32_t id = 0;
+  CHECK(search.nextProbe(clock_type::now(), TIMEOUT, id) == 0);
+}
+
+int main()
+{
+  testFullSizeFirst();
+  testExpiryLowersBound();
+  testProbeIds();
+  testConverges(1448);
+  testConverges(3948);
+  testConverges(8948);
+  testConverges(1148);
+  testCeilingBelowBase();
+  return checkResult("path_mtu_test");
+}
@@ -0,0 +1,72 @@
+#include "../Socket/rtt_estimator.hpp"
+#include "check.hpp"
+
+using std::chrono::milliseconds;
+
+// Before any sample the RTO is one second, the first sample sets SRTT to it
+// and RTTVAR to half of it, later ones are smoothed by 1/8 and 1/4
+// (RFC 6298 section 2)
+static void testRfc6298Values()
+{
+  RttEstimator rtt;
+  CHECK(rtt.getRto() == RTO_INITIAL);
+  CHECK(rtt.getSrtt() == microseconds(0));
+
+  rtt.addSample(milliseconds(100));
+  CHECK(rtt.getSrtt() == milliseconds(100));
+  CHECK(rtt.getRto() == milliseconds(300));
+
+  // RTTVAR = 3/4 * 50ms + 1/4 * 100ms, SRTT = 7/8 * 100ms + 1/8 * 200ms
+  rtt.addSample(milliseconds(200));
+  CHECK(rtt.getSrtt() == microseconds(112500));
+  CHECK(rtt.getRto() == microseconds(112500 + 4 * 62500));
+
+  rtt.reset();
+  CHECK(rtt.getRto() == RTO_INITIAL);
+  CHECK(rtt.getSrtt() == microseconds(0));
+}
+
+// Tiny and negative samples cannot push the RTO below RTO_MIN
+static void testMinimum()
+{
+  RttEstimator rtt;
+  rtt.addSample(microseconds(-5));
+  CHECK(rtt.getRto() == RTO_INITIAL);
+  rtt.addSample(microseconds(1));
+  CHECK(rtt.getRto() == RTO_MIN);
+}
+
+// Each timeout doubles the RTO up to RTO_MAX, the next valid sample brings
+// it back; a retransmitted segment's sample does not (Karn's rule)
+static void testBackoffAndKarn()
+{
+  RttEstimator rtt;
+  rtt.addSample(milliseconds(100));
+  rtt.backoff();
+  CHECK(rtt.getRto() == milliseconds(600));
+  rtt.backoff();
+  CHECK(rtt.getRto() == milliseconds(1200));
+
+  rtt.addSample(milliseconds(100), true);
+  CHECK(rtt.getRto() == milliseconds(1200));
+  CHECK(rtt.getSrtt() == milliseconds(100));
+
+  rtt.addSample(milliseconds(100), false);
+  CHECK(rtt.getRto() == microseconds(100000 + 4 * 37500));
+
+  for (int i = 0; i < 20; i++)
+  {
+    rtt.backoff();
+  }
+  CHECK(rtt.getRto() == RTO_MAX);
+  rtt.backoff();
+  CHECK(rtt.getRto() == RTO_MAX);
+}
+
+int main()
+{
+  testRfc6298Values();
+  testMinimum();
+  testBackoffAndKarn();
+  return checkResult("rtt_estimator_test");
+}
@@ -0,0 +1,140 @@
+#include "../Segment/segment.hpp"
+#include "../Segment/segment_handler.hpp"
+#include "check.hpp"
+#include <vector>
+
+static bool sameBlocks(const vector<SackBlock> &a, const vector<SackBlock> &b)
+{
+  if (a.size() != b.size())
+  {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++)
+  {
+    if (a[i].start != b[i].start || a[i].end != b[i].end)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Blocks come back from the wire as they were set, in order and across the
+// seqNum wrap
+static void testEncodeDecode()
+{
+  vector<SackBlock> blocks = {{0xFFFFFFFE, 3}, {10, 12}, {20, 21}, {30, 40}};
+  Segment segment = ack(7, 0xFFFFFFF0);
+  setSackBlocks(segment, blocks);
+  updateChecksum(segment);
+
+  uint8_t buffer[MAX_DATAGRAM_SIZE];
+  encodeSegment(segment, buffer);
+  Segment decoded;
+  CHECK(decodeSegment(buffer, headerLength(segment), decoded));
+  CHECK(sameBlocks(getSackBlocks(decoded), blocks));
+}
+
+// Next to another option fewer blocks fit, the newest ones are kept and the
+// other option survives
+static void testBesideOtherOptions()
+{
+  vector<SackBlock> blocks = {{5, 6}, {10, 12}, {20, 21}, {30, 40}};
+  Segment segment = ack(7, 3);
+  setWindowScale(segment, 7);
+  setSackBlocks(segment, blocks);
+  blocks.resize(3);
+  CHECK(sameBlocks(getSackBlocks(segment), blocks));
+  uint8_t shift = 0;
+  CHECK(getWindowScale(segment, shift) && shift == 7);
+}
+
+// Only MAX_SACK_BLOCKS fit, the first ones are kept; no blocks means no
+// option at all
+static void testLimits()
+{
+  vector<SackBlock> blocks;
+  for (uint32_t i = 0; i < MAX_SACK_BLOCKS + 2; i++)
+  {
+    blocks.push_back(SackBlock{i * 10, i * 10 + 5});
+  }
+  Segment segment = ack(1, 2);
+  setSackBlocks(segment, blocks);
+  blocks.resize(MAX_SACK_BLOCKS);
+  CHECK(sameBlocks(getSackBlocks(segment), blocks));
+
+  Segment plain = ack(1, 2);
+  setSackBlocks(plain, {});
+  CHECK(plain.data_offset == 6);
+  CHECK(getSackBlocks(plain).empty());
+}
+
+// A handler sending 16 segments whose seqNums wrap in the middle
+struct Sender
+{
+  vector<uint8_t> data;
+  SegmentHandler handler;
+  uint32_t first;
+
+  explicit Sender(uint32_t first)
+      : data(16 * MAX_PAYLOAD_SIZE, 0x5A), first(first)
+  {
+    handler.setDataStream(data.data(), data.size(), first, 1, 2);
+    for (int i = 0; i < 10; i++)
+    {
+      handler.advanceWindow(1);
+    }
+  }
+};
+
+// SACK marks exactly the sent segments it covers, once
+static void testApplySack()
+{
+  Sender sender(0xFFFFFFFC);
+  SegmentHandler &handler = sender.handler;
+  uint32_t first = sender.first;
+
+  CHECK(handler.applySack({{first + 3, first + 6}}) == 3);
+  CHECK(!handler.isAcked(first + 2));
+  CHECK(handler.isAcked(first + 3));
+  CHECK(handler.isAcked(first + 5));
+  CHECK(!handler.isAcked(first + 6));
+  // Repeated blocks change nothing
+  CHECK(handler.applySack({{first + 3, first + 6}}) == 0);
+
+  // Clipped to what was sent (10 segments) and to what is not yet
+  // cumulatively acknowledged
+  CHECK(handler.applySack({{first + 8, first + 14}}) == 2);
+  CHECK(!handler.isAcked(first + 10));
+  CHECK(handler.applySack({{first - 5, first}}) == 0);
+
+  // The cumulative ACK slides over everything SACKed right behind it
+  CHECK(handler.acknowledge(first + 3) == 6);
+  CHECK(handler.getCurrentAckNum() == first + 5);
+}
+
+// Selective Repeat's per segment ACK: each one counts once, ACKs naming
+// segments already covered or never sent are ignored
+static void testMarkAcked()
+{
+  Sender sender(0x7FFFFFFE);
+  SegmentHandler &handler = sender.handler;
+  uint32_t first = sender.first;
+
+  CHECK(handler.markAcked(first + 4));
+  CHECK(!handler.markAcked(first + 4));
+  CHECK(!handler.markAcked(first + 10));
+  CHECK(!handler.markAcked(first - 1));
+  CHECK(handler.markAcked(first));
+  CHECK(handler.getCurrentAckNum() == first);
+}
+
+int main()
+{
+  testEncodeDecode();
+  testBesideOtherOptions();
+  testLimits();
+  testApplySack();
+  testMarkAcked();
+  return checkResult("sack_test");
+}
@@ -0,0 +1,74 @@
+#include "../Segment/segment.hpp"
+#include "../Segment/segment_handler.hpp"
+#include "check.hpp"
+#include <vector>
+
+// Comparisons follow RFC 1982: b is after a when it is less than 2^31 ahead,
+// so the order holds across the wrap from 2^32 - 1 to 0
+static void testComparisons()
+{
+  CHECK(seqLt(1, 2));
+  CHECK(seqLt(0xFFFFFFFF, 0));
+  CHECK(seqLt(0xFFFFFFF0, 5));
+  CHECK(seqGt(5, 0xFFFFFFF0));
+  CHECK(!seqLt(5, 0xFFFFFFF0));
+  CHECK(seqLeq(7, 7) && seqGeq(7, 7) && !seqLt(7, 7) && !seqGt(7, 7));
+
+  // Just under half the space ahead is still after, just over half is
+  // before. Exactly half is undefined (RFC 1982), nothing relies on it.
+  CHECK(seqLt(0, 0x7FFFFFFF));
+  CHECK(seqLt(0x80000000, 0xFFFFFFFF));
+  CHECK(seqLt(0xC0000000, 0x3FFFFFFF));
+  CHECK(!seqLt(0, 0x80000001));
+  CHECK(seqLt(0x80000001, 0));
+
+  CHECK(seqMax(0xFFFFFFFE, 1) == 1);
+  CHECK(seqMin(0xFFFFFFFE, 1) == 0xFFFFFFFE);
+  CHECK(seqMax(3, 3) == 3);
+}
+
+// Loops that walk seqNums with seqLt visit every one across the wrap
+static void testWalkAcrossWrap()
+{
+  uint32_t visited = 0;
+  for (uint32_t seqNum = 0xFFFFFFFA; seqLt(seqNum, 4); seqNum++)
+  {
+    visited++;
+  }
+  CHECK(visited == 10);
+}
+
+// A transfer whose seqNums wrap is acknowledged like any other, including
+// an ackNum of 0
+static void testHandlerAcrossWrap()
+{
+  std::vector<uint8_t> data(8 * MAX_PAYLOAD_SIZE, 1);
+  SegmentHandler handler;
+  uint32_t first = 0xFFFFFFFC;
+  handler.setDataStream(data.data(), data.size(), first, 1, 2);
+  handler.markEOF();
+  for (int i = 0; i < 8; i++)
+  {
+    CHECK(handler.advanceWindow(1) != nullptr);
+  }
+  CHECK(handler.getCurrentSeqNum() == 3);
+  CHECK(handler.advanceWindow(1) == nullptr);
+
+  // ackNum 0 acknowledges 0xFFFFFFFC to 0xFFFFFFFF
+  CHECK(handler.acknowledge(0) == 4);
+  CHECK(handler.getCurrentAckNum() == 0xFFFFFFFF);
+  // Stale and future ACKs are ignored
+  CHECK(handler.acknowledge(0xFFFFFFFE) == 0);
+  CHECK(handler.acknowledge(100) == 0);
+  CHECK(!handler.isFinished(first));
+  CHECK(handler.acknowledge(4) == 4);
+  CHECK(handler.isFinished(first));
+}
+
+int main()
+{
+  testComparisons();
+  testWalkAcrossWrap();
+  testHandlerAcrossWrap();
+  return checkResult("serial_number_test");
+}
@@ -2,6 +2,9 @@
 #include <fstream>
 #include <bitset>
 #include <sstream>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
 #include "../Node/client.hpp"
 #include "../Node/server.hpp"
 
@@ -59,3 +62,25 @@ void convertFromStrToFile(const std::string &outputFile, const std::string &cont
 
   output.close();
 }
+
+bool moveReceivedFile(const std::string &partialPath, const std::string &outputFile)
+{
+  if (std::rename(partialPath.c_str(), outputFile.c_str()) != 0)
+  {
+    std::cerr << ERROR << " Unable to move received data to: " << outputFile << " (" << std::strerror(errno) << ")" << std::endl;
+    return false;
+  }
+
+  std::cout << OUT << " Client content successfully written to the file: " << outputFile << std::endl;
+  return true;
+}
+
+std::string takeReceivedText(const std::string &partialPath)
+{
+  std::ifstream input(partialPath, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(input)),
+                      std::istreambuf_iterator<char>());
+  input.close();
+  std::remove(partialPath.c_str());
+  return content;
+}
@@ -10,4 +10,9 @@ void convertFromBinary(const std::string &binaryFile,
                        const std::string &outputFile);
 
 void convertFromStrToFile(const std::string &outputFile, const std::string &content);
+
+// Give a fully received partial file its real name
+bool moveReceivedFile(const std::string &partialPath, const std::string &outputFile);
+// Read back a received text message and remove its partial file
+std::string takeReceivedText(const std::string &partialPath);
 #endif
\ No newline at end of file
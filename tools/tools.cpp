@@ -15,11 +15,11 @@ std::string brackets(std::string str)
     return " [" + str + "] ";
 }
 
-int generateRandomNumber(int min, int max)
+uint32_t generateRandomNumber(uint32_t min, uint32_t max)
 {
     unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
     std::default_random_engine engine(seed);
-    std::uniform_int_distribution<int> distribution(min, max);
+    std::uniform_int_distribution<uint32_t> distribution(min, max);
     return distribution(engine);
 }
 
@@ -7,6 +7,7 @@
 #include <random>
 #include <chrono>
 #include <bitset>
+#include <cstdint>
 
 const std::string INPUT = "[?]";
 const std::string IN = "[i]";
@@ -19,7 +20,7 @@ bool isNumber(const std::string &str);
 void commandLine(char symbol, std::string str);
 std::string brackets(std::string str);
 
-int generateRandomNumber(int min, int max);
+uint32_t generateRandomNumber(uint32_t min, uint32_t max);
 std::string binaryToString(const std::string &binary);
 std::string stringToBinary(const std::string &input);
 #endif
\ No newline at end of file